@@ -22,23 +22,60 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "instrumentation.h"
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// x86 vector intrinsics (SSE2 is always there on x86-64; the SSSE3 and AVX2
+// kernels are chosen at run time, see simdLevel)
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 // The data structure
 //
-// An image is stored in a structure containing 3 fields:
+// An image is stored in a structure containing these fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the 8-bit gray
+// Another field is a pointer to an array that stores the 8-bit gray
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
-// For example, in a 100-pixel wide image (img->width == 100),
+// Consecutive rows start img->stride pixels apart.  The pixels of an image
+// that owns them start on a ROW_ALIGN-byte boundary, and, unless that would
+// waste more than an eighth of the memory, stride is width rounded up to a
+// multiple of ROW_ALIGN:  then every row is aligned, and vector kernels may
+// use aligned loads over whole rows, with no scalar tails.  For example, in
+// a 1000-pixel wide image (img->width == 1000, img->stride == 1024),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
-//   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//   pixel position (x,y) = (22,1) is stored in img->pixel[1046].
+// The padding pixels at the end of each row belong to no position, and
+// their contents are unspecified (whole-row kernels may overwrite them).
+// Narrow images keep packed rows (stride == width), and so do mapped images
+// (see ImageLoadMapped), which hold the rows of the file.
+//
+// An image may also be a view of a rectangle of another (parent) image.
+// A view shares the parent's pixel array:  its pixel field points to the
+// top left corner of the rectangle, and its stride is the parent's stride.
+//
+// An image that owns its pixels caches their statistics (see ImageStats).
+// Every operation that changes pixels marks the owner of the pixels dirty
+// (see touch), which invalidates the cache.
+//
+// The structure and the pixels it owns are a single memory block (see
+// Image allocation below).
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -47,12 +84,35 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Statistics of the pixels of an image (see ImageStats)
+struct imageStats {
+  uint8 min, max;
+  uint64_t sum;
+  uint64_t hist[256];  // number of pixels of each level
+};
+
+// Statistics cache of an image that owns its pixels (see imageStats)
+struct statsCache {
+  pthread_mutex_t lock;   // guards st, and its recomputation
+  struct imageStats st;   // valid if the image is not dirty
+};
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
+  int stride;    // distance between the starts of consecutive rows
   int maxval;    // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel;  // pixel data (a raster scan)
+  Image parent;  // image whose pixels this one views (NULL if it owns them)
+  void* map;     // start of the file mapping holding the pixels (or NULL)
+  size_t maplen; // length of that mapping
+  int sizeclass; // size class of the memory block holding the image
+  ImageArena arena;  // arena the image belongs to (or NULL)
+  Image prev, next;  // neighbours in the arena's list of images
+  atomic_int dirty;  // pixels changed since stats was computed
+  struct statsCache* stats;  // cached statistics (allocated when first
+                             // computed, owned pixels only)
 };
 
 // This module follows "design-by-contract" principles.
@@ -159,24 +219,596 @@ static inline int round(double n) {
   return n > 0 ? (int)(n + 0.5) : (int)(n - 0.5);
 }
 
+// CPU features
+//
+// Kernels that need more than SSE2 (SSSE3, AVX2) are compiled for their
+// instruction set with target attributes, whatever the compiler flags, and
+// called only if the CPU running the program has it.  So a plain build
+// (without -march) still gets the fastest kernels the machine supports.
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_DISPATCH 1
+#else
+#define SIMD_DISPATCH 0
+#endif
+
+enum { SIMD_NONE, SIMD_SSSE3, SIMD_AVX2 };
+
+// Best vector extension of the CPU (SIMD_*), found on the first call.
+static int simdLevel(void) {
+#if SIMD_DISPATCH
+  static atomic_int level = -1;
+  int l = atomic_load_explicit(&level, memory_order_relaxed);
+  if (l < 0) {
+    __builtin_cpu_init();
+    l = __builtin_cpu_supports("avx2")    ? SIMD_AVX2
+        : __builtin_cpu_supports("ssse3") ? SIMD_SSSE3
+                                          : SIMD_NONE;
+    atomic_store_explicit(&level, l, memory_order_relaxed);
+  }
+  return l;
+#else
+  return SIMD_NONE;
+#endif
+}
+
+// Worker thread pool
+//
+// Operations that sweep a whole image split it into tasks (usually bands of
+// consecutive rows) and run them on a pool of worker threads created once,
+// by ImageInit, instead of creating threads on every call.  The calling
+// thread takes part too, so a pool of n threads has n-1 workers.
+//
+// Tasks are distributed by work stealing:  each thread starts with its own
+// contiguous range of task numbers (so neighbouring rows stay on the same
+// core) and takes tasks from the front of it.  A thread that runs out steals
+// the back half of the range of another thread that still has work.  So the
+// load balances itself when tasks are uneven or some cores are busy.
+//
+// Tasks must not touch shared state other than their own output, and must
+// not fail.  A task that runs a parallel operation itself runs it serially.
+
+#define POOL_MAXTHREADS 256
+
+// Range of task numbers [next, end) still to be taken by one thread
+struct poolRange {
+  pthread_mutex_t lock;
+  int next, end;
+};
+
+static struct {
+  int nthreads;                 // threads running tasks (including the caller)
+  pthread_t worker[POOL_MAXTHREADS];
+  struct poolRange range[POOL_MAXTHREADS];
+  pthread_mutex_t lock;         // protects the fields below
+  pthread_cond_t start, done;
+  unsigned long generation;     // number of jobs started so far
+  int pending;                  // workers still running the current job
+  int quit;
+  void (*task)(void* arg, int i);
+  void* arg;
+} pool = {
+    .nthreads = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Serializes jobs submitted by different threads
+static pthread_mutex_t poolJobLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while a thread is running pool tasks
+static _Thread_local int poolBusy;
+
+// Take a task from range r.  Returns -1 if r is empty.
+static int poolTake(struct poolRange* r) {
+  pthread_mutex_lock(&r->lock);
+  int i = r->next < r->end ? r->next++ : -1;
+  pthread_mutex_unlock(&r->lock);
+  return i;
+}
+
+// Steal the back half of the range of another thread into range self.
+// Returns the first stolen task, or -1 if there is nothing left anywhere.
+static int poolSteal(int self) {
+  int n = pool.nthreads;
+  for (int k = 1; k < n; ++k) {
+    struct poolRange* v = &pool.range[(self + k) % n];
+    pthread_mutex_lock(&v->lock);
+    int left = v->end - v->next;
+    int mid = v->end - (left + 1) / 2;
+    int end = v->end;
+    if (left > 0) v->end = mid;
+    pthread_mutex_unlock(&v->lock);
+    if (left > 0) {
+      struct poolRange* r = &pool.range[self];
+      pthread_mutex_lock(&r->lock);
+      r->next = mid + 1;
+      r->end = end;
+      pthread_mutex_unlock(&r->lock);
+      return mid;
+    }
+  }
+  return -1;
+}
+
+// Run tasks of the current job as thread self, until none are left.
+static void poolWork(int self) {
+  poolBusy = 1;
+  for (;;) {
+    int i = poolTake(&pool.range[self]);
+    if (i < 0) i = poolSteal(self);
+    if (i < 0) break;
+    pool.task(pool.arg, i);
+  }
+  poolBusy = 0;
+}
+
+// Body of worker thread number (intptr_t)arg.
+static void* poolWorker(void* arg) {
+  int self = (int)(intptr_t)arg;
+  unsigned long seen = 0;
+  InstrThreadStart();
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.quit && pool.generation == seen) {
+      pthread_cond_wait(&pool.start, &pool.lock);
+    }
+    if (pool.quit) {
+      pthread_mutex_unlock(&pool.lock);
+      InstrThreadStop();
+      return NULL;
+    }
+    seen = pool.generation;
+    pthread_mutex_unlock(&pool.lock);
+
+    poolWork(self);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.pending == 0) pthread_cond_signal(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+// Stop and join all workers.
+static void poolStop(void) {
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+  for (int i = 1; i < pool.nthreads; ++i) {
+    pthread_join(pool.worker[i], NULL);
+  }
+  for (int i = 0; i < pool.nthreads; ++i) {
+    pthread_mutex_destroy(&pool.range[i].lock);
+  }
+  pool.nthreads = 1;
+  pool.quit = 0;
+}
+
+// Start a pool of (up to) n threads.
+// If some workers cannot be created, the pool is simply smaller.
+static void poolStart(int n) {
+  n = max(1, min(n, POOL_MAXTHREADS));
+  pthread_mutex_init(&pool.range[0].lock, NULL);
+  pool.nthreads = 1;
+  pool.generation = 0;
+  for (int i = 1; i < n; ++i) {
+    pthread_mutex_init(&pool.range[i].lock, NULL);
+    if (pthread_create(&pool.worker[i], NULL, poolWorker, (void*)(intptr_t)i) != 0) {
+      pthread_mutex_destroy(&pool.range[i].lock);
+      break;
+    }
+    pool.nthreads++;
+  }
+}
+
+// Run task(arg, i) for every i in [0, ntasks), on all threads of the pool.
+// Returns when all tasks are done.
+static void poolRun(int ntasks, void (*task)(void* arg, int i), void* arg) {
+  if (pool.nthreads == 1 || ntasks <= 1 || poolBusy) {
+    for (int i = 0; i < ntasks; ++i) {
+      task(arg, i);
+    }
+    return;
+  }
+  pthread_mutex_lock(&poolJobLock);
+  int n = pool.nthreads;
+  for (int t = 0; t < n; ++t) {
+    pool.range[t].next = (int)((long)ntasks * t / n);
+    pool.range[t].end = (int)((long)ntasks * (t + 1) / n);
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.task = task;
+  pool.arg = arg;
+  pool.pending = n - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+
+  poolWork(0);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.pending > 0) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&poolJobLock);
+}
+
+// Row-band jobs
+//
+// Most operations are a loop over rows; they describe the work on rows
+// [y0, y1) with a function and let poolRows split the rows into bands.
+
+// Bands carry at least this many bytes of work, so that small images are
+// not worth waking the workers for
+#define POOL_MIN_BAND_BYTES (64 * 1024)
+
+struct rowJob {
+  void (*rows)(void* arg, int y0, int y1);
+  void* arg;
+  int height, nbands;
+};
+
+static void rowJobTask(void* arg, int i) {
+  struct rowJob* job = arg;
+  int y0 = (int)((long)job->height * i / job->nbands);
+  int y1 = (int)((long)job->height * (i + 1) / job->nbands);
+  if (y0 < y1) job->rows(job->arg, y0, y1);
+}
+
+// Run rows(arg, y0, y1) over bands covering rows [0, height), where each
+// row costs about rowbytes bytes of memory traffic.
+static void poolRows(int height, size_t rowbytes, void (*rows)(void* arg, int y0, int y1), void* arg) {
+  // Several bands per thread, so that stealing can even out the load
+  size_t nbands = (size_t)height * rowbytes / POOL_MIN_BAND_BYTES;
+  if (nbands > (size_t)4 * pool.nthreads) nbands = (size_t)4 * pool.nthreads;
+  if (nbands > (size_t)height) nbands = (size_t)height;
+  if (nbands < 1) nbands = 1;
+  struct rowJob job = {rows, arg, height, (int)nbands};
+  poolRun(job.nbands, rowJobTask, &job);
+}
+
+// Number of threads to use by default: $IMAGE_THREADS if set, otherwise
+// one per online processor.
+static int defaultThreads(void) {
+  const char* env = getenv("IMAGE_THREADS");
+  if (env != NULL && atoi(env) > 0) {
+    return atoi(env);
+  }
+#if defined(_SC_NPROCESSORS_ONLN)
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu > 0) return min((int)ncpu, POOL_MAXTHREADS);
+#endif
+  return 1;
+}
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters, and start the worker threads (see
+/// ImageSetThreads).  Instrumentation is calibrated only when first
+/// needed (see InstrCalibrateOnce).
 void ImageInit(void) {  ///
-  InstrCalibrate();
+  ImageSetThreads(defaultThreads());
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   InstrName[1] = "pixcmp";
   InstrName[2] = "pixadd";
+  InstrName[3] = "poolhit";  // image allocations served by recycled blocks
+  InstrName[4] = "poolmiss"; // image allocations that needed malloc
+}
+
+/// Set the number of threads used by image operations to n (n >= 1).
+/// n == 1 makes every operation run serially in the calling thread.
+/// ImageInit sets it from the IMAGE_THREADS environment variable, or to the
+/// number of processors if that is not set.
+/// Results never depend on the number of threads.
+void ImageSetThreads(int n) {  ///
+  assert(n >= 1);
+  pthread_mutex_lock(&poolJobLock);
+  poolStop();
+  poolStart(n);
+  pthread_mutex_unlock(&poolJobLock);
+}
+
+/// Number of threads used by image operations.
+int ImageThreads(void) {  ///
+  return pool.nthreads;
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+// (Each thread has its own counters, see instrumentation.h.)
+// Build with -DINSTRUMENT=0 to compile all counting away:  every
+// "PIXMEM += n;" then becomes a loop body that never runs.
+#ifndef INSTRUMENT
+#define INSTRUMENT 1
+#endif
+#if INSTRUMENT
+#define COUNTER(i) InstrCount[i]
+#else
+#define COUNTER(i) while (0) InstrCount[i]
+#endif
+#define PIXMEM COUNTER(0)
 // Add more macros here...
-#define PIXCMP InstrCount[1]
-#define PIXADD InstrCount[2]
+#define PIXCMP COUNTER(1)
+#define PIXADD COUNTER(2)
+#define POOLHIT COUNTER(3)
+#define POOLMISS COUNTER(4)
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
+// Release a file mapping made by ImageLoadMapped.
+// Preserves global errno.
+static void unmapFile(void* map, size_t len) {
+#if defined(__linux__) || defined(__APPLE__)
+  errsave = errno;
+  munmap(map, len);
+  errno = errsave;
+#else
+  (void)map;
+  (void)len;
+#endif
+}
+
+// Image allocation
+//
+// An image and its pixels are allocated as a single block:  the structure,
+// followed by the pixel array (views and mapped images, which own no
+// pixels, take blocks with just the structure).  So creating an image is
+// one allocation, not two.
+//
+// Blocks are recycled:  ImageDestroy returns them to a pool, with one free
+// list per size class, and allocations of the same class reuse them.
+// Recycled blocks are already mapped and faulted in, so pipelines that
+// create and destroy many images of similar sizes (every geometric
+// operation creates one) stop paying for malloc, for returning memory to
+// the system, and for the page faults of fresh memory.
+// Classes grow in quarter powers of 2, so a block is at most 25% larger
+// than needed.  The pool keeps at most a limit of bytes (BLOCK_CACHE_BYTES,
+// unless set by ImagePoolSetLimit); blocks beyond that are freed, and
+// ImagePoolTrim returns all of them to the system.
+//
+// An image may also belong to an arena, which keeps a list of its images
+// so that they can all be destroyed in one call (see ImageArenaCreate).
+
+#define BLOCK_NCLASSES 160                     // up to 2^48 bytes
+#define ROW_ALIGN 64                           // alignment of pixel rows
+#define BLOCK_CACHE_BYTES ((size_t)256 << 20)  // default pool limit: 256 MiB
+
+// A block in a free list
+struct freeBlock {
+  struct freeBlock* next;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct freeBlock* free[BLOCK_NCLASSES];
+  size_t cached;  // bytes in the free lists
+  size_t limit;   // most bytes kept in the free lists
+} blocks = {.lock = PTHREAD_MUTEX_INITIALIZER, .limit = BLOCK_CACHE_BYTES};
+
+struct imageArena {
+  pthread_mutex_t lock;
+  Image first;  // list of the images of the arena
+};
+
+// Arena of the images created by this thread
+static _Thread_local ImageArena currentArena;
+
+// Size of the blocks of class c:  256, 320, 384, 448, 512, 640, ...
+static size_t classSize(int c) {
+  return ((size_t)4 + c % 4) << (c / 4 + 6);
+}
+
+// Allocate a block of at least n bytes, and set *sizeclass to its class.
+// Returns NULL if memory is short.
+static void* blockAlloc(size_t n, int* sizeclass) {
+  int c = 0;
+  while (c + 4 < BLOCK_NCLASSES && classSize(c + 4) < n) {
+    c += 4;
+  }
+  while (c < BLOCK_NCLASSES && classSize(c) < n) {
+    c++;
+  }
+  if (c == BLOCK_NCLASSES) return NULL;
+  *sizeclass = c;
+
+  pthread_mutex_lock(&blocks.lock);
+  struct freeBlock* b = blocks.free[c];
+  if (b != NULL) {
+    blocks.free[c] = b->next;
+    blocks.cached -= classSize(c);
+  }
+  pthread_mutex_unlock(&blocks.lock);
+  if (b != NULL) {
+    POOLHIT += 1;
+    return b;
+  }
+  POOLMISS += 1;
+  return malloc(classSize(c));
+}
+
+// Return block of class c to the pool (or to the system, if the pool is full).
+static void blockFree(void* block, int c) {
+  pthread_mutex_lock(&blocks.lock);
+  int keep = blocks.cached + classSize(c) <= blocks.limit;
+  if (keep) {
+    struct freeBlock* b = block;
+    b->next = blocks.free[c];
+    blocks.free[c] = b;
+    blocks.cached += classSize(c);
+  }
+  pthread_mutex_unlock(&blocks.lock);
+  if (!keep) free(block);
+}
+
+// Free blocks of the pool, largest first, until at most limit bytes remain.
+static void blockTrim(size_t limit) {
+  struct freeBlock* trimmed = NULL;
+  pthread_mutex_lock(&blocks.lock);
+  for (int c = BLOCK_NCLASSES - 1; c >= 0 && blocks.cached > limit; --c) {
+    while (blocks.free[c] != NULL && blocks.cached > limit) {
+      struct freeBlock* b = blocks.free[c];
+      blocks.free[c] = b->next;
+      blocks.cached -= classSize(c);
+      b->next = trimmed;
+      trimmed = b;
+    }
+  }
+  pthread_mutex_unlock(&blocks.lock);
+  // Free outside the lock, so that other threads are not held up
+  while (trimmed != NULL) {
+    struct freeBlock* b = trimmed;
+    trimmed = b->next;
+    free(b);
+  }
+}
+
+/// Set the most bytes of destroyed images kept in the pool for reuse
+/// (256 MiB by default).  Blocks beyond the new limit are freed at once.
+/// bytes == 0 disables the pool.
+void ImagePoolSetLimit(size_t bytes) {  ///
+  pthread_mutex_lock(&blocks.lock);
+  blocks.limit = bytes;
+  pthread_mutex_unlock(&blocks.lock);
+  blockTrim(bytes);
+}
+
+/// Return all blocks kept in the pool to the system.
+/// Useful after a burst of large images, when memory is needed elsewhere.
+/// The pool keeps recycling the images destroyed afterwards.
+void ImagePoolTrim(void) {  ///
+  blockTrim(0);
+}
+
+// Allocate an image structure followed by room for npixels pixels, and
+// add it to the arena of this thread.  Only the allocation fields are set;
+// pixel points to the room for pixels, aligned to ROW_ALIGN bytes.
+// On failure, returns NULL and errCause is set.
+static Image imageAlloc(size_t npixels) {
+  int c;
+  Image img = blockAlloc(sizeof(struct image) + ROW_ALIGN - 1 + npixels, &c);
+  if (img == NULL) {
+    errCause = "Memory allocation for image failed";
+    return NULL;
+  }
+  img->sizeclass = c;
+  atomic_init(&img->dirty, 1);
+  img->stats = NULL;
+  img->pixel = (uint8*)(((uintptr_t)(img + 1) + ROW_ALIGN - 1) & ~(uintptr_t)(ROW_ALIGN - 1));
+  img->parent = NULL;
+  img->map = NULL;
+  img->maplen = 0;
+  img->arena = currentArena;
+  img->prev = NULL;
+  img->next = NULL;
+  if (img->arena != NULL) {
+    pthread_mutex_lock(&img->arena->lock);
+    img->next = img->arena->first;
+    if (img->next != NULL) img->next->prev = img;
+    img->arena->first = img;
+    pthread_mutex_unlock(&img->arena->lock);
+  }
+  return img;
+}
+
+// Remove img from its arena, and release its block.
+// Preserves global errno.
+static void imageFree(Image img) {
+  if (img->arena != NULL) {
+    pthread_mutex_lock(&img->arena->lock);
+    if (img->prev != NULL) {
+      img->prev->next = img->next;
+    } else {
+      img->arena->first = img->next;
+    }
+    if (img->next != NULL) img->next->prev = img->prev;
+    pthread_mutex_unlock(&img->arena->lock);
+  }
+  errsave = errno;
+  if (img->stats != NULL) {
+    pthread_mutex_destroy(&img->stats->lock);
+    free(img->stats);
+  }
+  blockFree(img, img->sizeclass);
+  errno = errsave;
+}
+
+// Row stride of an image of the given width that owns its pixels:
+// rounded up to ROW_ALIGN, unless the padding would exceed width/8.
+static int alignedStride(int width) {
+  int stride = (int)(((size_t)width + ROW_ALIGN - 1) & ~(size_t)(ROW_ALIGN - 1));
+  return stride - width <= width / 8 ? stride : width;
+}
+
+// Create a new image with uninitialized pixels.  (For operations that set
+// every pixel.)  The padding is zeroed, so that it is never uninitialized.
+static Image newImage(int width, int height, uint8 maxval) {
+  if (width > INT_MAX - (ROW_ALIGN - 1)) {
+    errCause = "Image too wide";
+    return NULL;
+  }
+  int stride = alignedStride(width);
+  Image img = imageAlloc((size_t)stride * height);
+  if (img == NULL) return NULL;
+  img->width = width;
+  img->height = height;
+  img->stride = stride;
+  img->maxval = maxval;
+  if (stride > width) {
+    for (int y = 0; y < height; ++y) {
+      memset(img->pixel + (size_t)y * stride + width, 0, (size_t)(stride - width));
+    }
+  }
+  return img;
+}
+
+/// Create an empty arena.
+/// While an arena is in use by a thread (see ImageArenaUse), every image
+/// created by that thread belongs to it, and ImageArenaRelease destroys
+/// all of them at once.
+///
+/// On success, a new arena is returned.
+/// (The caller is responsible for releasing the returned arena!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageArena ImageArenaCreate(void) {  ///
+  ImageArena arena = malloc(sizeof(struct imageArena));
+  if (!check(arena != NULL, "Memory allocation for ImageArena failed")) {
+    return NULL;
+  }
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->first = NULL;
+  return arena;
+}
+
+/// Make the images created from now on by the calling thread belong to
+/// arena (or to no arena, if arena is NULL).
+/// Returns the arena that was in use before.
+ImageArena ImageArenaUse(ImageArena arena) {  ///
+  ImageArena previous = currentArena;
+  currentArena = arena;
+  return previous;
+}
+
+/// Destroy all images still in the arena pointed to by (*ap), then the
+/// arena itself.  Images of the arena must not be used afterwards.
+/// If (*ap)==NULL, no operation is performed.
+/// Ensures: (*ap)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void ImageArenaRelease(ImageArena* ap) {  ///
+  assert(ap != NULL);
+  ImageArena arena = *ap;
+  if (arena == NULL) return;
+  while (arena->first != NULL) {
+    Image img = arena->first;
+    ImageDestroy(&img);
+  }
+  if (currentArena == arena) currentArena = NULL;
+  pthread_mutex_destroy(&arena->lock);
+  free(arena);
+  *ap = NULL;
+}
+
 /// Image management functions
 
 /// Create a new black image.
@@ -192,23 +824,15 @@ Image ImageCreate(int width, int height, uint8 maxval) {  ///
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
 
-  Image img = (Image)malloc(sizeof(struct image));
+  Image img = newImage(width, height, maxval);
 
+  // newImage() already sets errno/errCause
   if (img == NULL) {
-    errCause = "Memory allocation for Image structure failed";
     return NULL;
   }
 
-  img->width = width;
-  img->height = height;
-  img->maxval = maxval;
-  img->pixel = malloc(img->width * img->height * sizeof(uint8));
-
-  if (img->pixel == NULL) {
-    errCause = "Memory allocation for pixel array failed";
-    free(img);
-    return NULL;
-  }
+  // Recycled blocks hold old pixels
+  memset(img->pixel, 0, (size_t)img->stride * height);
 
   return img;
 }
@@ -222,15 +846,57 @@ void ImageDestroy(Image* imgp) {  ///
   assert(imgp != NULL);
 
   Image img = *imgp;
+  if (img == NULL) return;
 
-  free(img->pixel);
-  free(img);
+  // Views do not own their pixels, and owned pixels are in the same block
+  if (img->parent == NULL && img->map != NULL) {
+    unmapFile(img->map, img->maplen);
+  }
+  imageFree(img);
 
   *imgp = NULL;
 
   assert(*imgp == NULL);
 }
 
+/// Create a view of a rectangular region of img.
+/// The view has width w and height h and shares the pixels of img:
+/// no pixels are copied, and changes made through either image are
+/// visible in the other.
+/// Requires:
+///   The rectangle must be inside the original image.
+///   The view must be destroyed (with ImageDestroy) before img.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) {  ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, w, h));
+
+  Image view = imageAlloc(0);
+
+  // imageAlloc() already sets errCause
+  if (view == NULL) {
+    return NULL;
+  }
+
+  view->width = w;
+  view->height = h;
+  view->stride = img->stride;
+  view->maxval = img->maxval;
+  view->pixel = img->pixel + (size_t)y * img->stride + x;
+  view->parent = img;
+
+  return view;
+}
+
+/// Check if img is a view of another image.
+int ImageIsView(Image img) {  ///
+  assert(img != NULL);
+  return img->parent != NULL;
+}
+
 /// PGM file operations
 
 // See also:
@@ -248,6 +914,22 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Read the packed rows of pixels of img from f.
+// Returns nonzero on success.
+static int readRows(Image img, FILE* f) {
+  size_t w = (size_t)img->width;
+  if (img->stride == img->width) {
+    size_t n = w * img->height;
+    return fread(img->pixel, sizeof(uint8), n, f) == n;
+  }
+  for (int y = 0; y < img->height; ++y) {
+    if (fread(img->pixel + (size_t)y * img->stride, sizeof(uint8), w, f) != w) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
@@ -272,9 +954,9 @@ Image ImageLoad(const char* filename) {  ///
       check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
       check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
       // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      (img = newImage(w, h, (uint8)maxval)) != NULL &&
       // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h, "Reading pixels");
+      check(readRows(img, f), "Reading pixels");
   PIXMEM += (unsigned long)(w * h);  // count pixel memory accesses
 
   // Cleanup
@@ -287,6 +969,119 @@ Image ImageLoad(const char* filename) {  ///
   return img;
 }
 
+// Parsing of PGM headers held in memory (for ImageLoadMapped).
+// These follow the same rules as the fscanf calls in ImageLoad:
+// each returns the position after what was matched.
+
+// Skip whitespace starting at position i of the n bytes of p.
+static size_t skipSpaceMem(const char* p, size_t i, size_t n) {
+  while (i < n && isspace((unsigned char)p[i])) i++;
+  return i;
+}
+
+// Skip 0 or more comment lines (and the whitespace after each one).
+static size_t skipCommentsMem(const char* p, size_t i, size_t n) {
+  while (i < n && p[i] == '#') {
+    while (i < n && p[i] != '\n') i++;
+    i = skipSpaceMem(p, i, n);
+  }
+  return i;
+}
+
+// Parse a nonnegative decimal integer into *value, after optional whitespace.
+// Returns 0 (no match) if there are no digits or the value overflows an int.
+static size_t parseIntMem(const char* p, size_t i, size_t n, int* value) {
+  i = skipSpaceMem(p, i, n);
+  if (i >= n || !isdigit((unsigned char)p[i])) return 0;
+  long v = 0;
+  while (i < n && isdigit((unsigned char)p[i])) {
+    v = 10 * v + (p[i++] - '0');
+    if (v > 0x7fffffff) return 0;
+  }
+  *value = (int)v;
+  return i;
+}
+
+/// Map a raw PGM file into memory.
+/// Like ImageLoad, but instead of reading the pixels into a new array, the
+/// file is mapped into memory and the image pixels point straight at the
+/// raster after the header.  Pages are only read from the file when first
+/// accessed, so loading is almost instant, even for huge files.
+///   writable: if 0, the mapping is read-only;  otherwise, it is a private
+///   copy-on-write mapping, and changes to the image never reach the file.
+/// Requires: a read-only mapped image must not be modified.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename, int writable) {  ///
+#if defined(__linux__) || defined(__APPLE__)
+  int w = 0, h = 0;
+  int maxval = 0;
+  int fd = -1;
+  struct stat st;
+  char* map = MAP_FAILED;
+  size_t len = 0;
+  size_t i = 0;
+  Image img = NULL;
+
+  int success =
+      check((fd = open(filename, O_RDONLY)) >= 0, "Open failed") &&
+      check(fstat(fd, &st) == 0 && st.st_size > 0, "Invalid file format") &&
+      (len = (size_t)st.st_size) > 0 &&
+      check((map = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                        MAP_PRIVATE, fd, 0)) != MAP_FAILED, "Mapping failed") &&
+      // Parse PGM header
+      check(len >= 2 && map[0] == 'P' && map[1] == '5', "Invalid file format") &&
+      (i = skipCommentsMem(map, skipSpaceMem(map, 2, len), len)) > 0 &&
+      check((i = parseIntMem(map, i, len, &w)) > 0, "Invalid width") &&
+      (i = skipCommentsMem(map, skipSpaceMem(map, i, len), len)) > 0 &&
+      check((i = parseIntMem(map, i, len, &h)) > 0, "Invalid height") &&
+      (i = skipCommentsMem(map, skipSpaceMem(map, i, len), len)) > 0 &&
+      check((i = parseIntMem(map, i, len, &maxval)) > 0 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
+      check(i < len && isspace((unsigned char)map[i]), "Whitespace expected") &&
+      check(len - (i + 1) >= (size_t)w * h, "Reading pixels") &&
+      // Allocate image structure only
+      (img = imageAlloc(0)) != NULL;
+
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->stride = w;
+    img->maxval = maxval;
+    img->pixel = (uint8*)map + i + 1;
+    img->map = map;
+    img->maplen = len;
+  }
+
+  // Cleanup
+  errsave = errno;
+  if (!success && map != MAP_FAILED) munmap(map, len);
+  if (fd >= 0) close(fd);  // the mapping stays valid after close
+  errno = errsave;
+  return success ? img : NULL;
+#else
+  // No mmap here: read the file as usual
+  (void)writable;
+  return ImageLoad(filename);
+#endif
+}
+
+// Write the pixels of img to f, as packed rows.
+// Returns nonzero on success.
+static int writeRows(Image img, FILE* f) {
+  size_t w = (size_t)img->width;
+  if (img->stride == img->width) {
+    size_t n = w * img->height;
+    return fwrite(img->pixel, sizeof(uint8), n, f) == n;
+  }
+  for (int y = 0; y < img->height; ++y) {
+    if (fwrite(img->pixel + (size_t)y * img->stride, sizeof(uint8), w, f) != w) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -301,7 +1096,7 @@ int ImageSave(Image img, const char* filename) {  ///
   int success =
       check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
       check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
-      check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h, "Writing pixels failed");
+      check(writeRows(img, f), "Writing pixels failed");
   PIXMEM += (unsigned long)(w * h);  // count pixel memory accesses
 
   // Cleanup
@@ -331,29 +1126,171 @@ int ImageMaxval(Image img) {  ///
   return img->maxval;
 }
 
+// The image that owns the pixels of img (img itself, if it is not a view).
+static inline Image owner(Image img) {
+  while (img->parent != NULL) {
+    img = img->parent;
+  }
+  return img;
+}
+
+// Mark the pixels of img changed, so that cached statistics are recomputed.
+// Writes through a view mark the image that owns the pixels.
+// Safe to call from concurrent writers of disjoint regions.
+static inline void touch(Image img) {
+  atomic_store_explicit(&owner(img)->dirty, 1, memory_order_relaxed);
+}
+
+// Guards the creation of stats caches (see imageStats)
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Histogram found so far by the bands of computeStats
+struct statsJob {
+  Image img;
+  pthread_mutex_t lock;
+  uint64_t* hist;
+};
+
+// Histogram banks:  consecutive pixels are counted in different banks, so
+// that runs of equal levels (common in real images) do not stall each
+// increment on the store of the previous one.
+#define HIST_BANKS 4
+
+// Add the counts of banks to hist, and clear them.
+static void histFlush(uint32_t banks[HIST_BANKS][256], uint64_t hist[256]) {
+  for (int v = 0; v < 256; ++v) {
+    uint64_t n = 0;
+    for (int b = 0; b < HIST_BANKS; ++b) {
+      n += banks[b][v];
+    }
+    hist[v] += n;
+  }
+  memset(banks, 0, HIST_BANKS * sizeof(banks[0]));
+}
+
+// Count the levels in rows [y0, y1) of job, then merge the band result into job.
+static void statsRows(void* arg, int y0, int y1) {
+  struct statsJob* job = arg;
+  Image img = job->img;
+  int w = img->width;
+  uint32_t banks[HIST_BANKS][256] = {{0}};
+  uint64_t hist[256] = {0};
+  size_t pending = 0;  // pixels counted in banks (flushed before a bank may overflow)
+  for (int y = y0; y < y1; ++y) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    int x = 0;
+    for (; x + HIST_BANKS <= w; x += HIST_BANKS) {
+      banks[0][row[x]]++;
+      banks[1][row[x + 1]]++;
+      banks[2][row[x + 2]]++;
+      banks[3][row[x + 3]]++;
+    }
+    for (; x < w; ++x) {
+      banks[0][row[x]]++;
+    }
+    pending += (size_t)w;
+    if (pending > UINT32_MAX - (size_t)w) {
+      histFlush(banks, hist);
+      pending = 0;
+    }
+  }
+  histFlush(banks, hist);
+  pthread_mutex_lock(&job->lock);
+  for (int v = 0; v < 256; ++v) {
+    job->hist[v] += hist[v];
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+// Compute the statistics of img in a single pass over its pixels:
+// min, max and sum all follow from the histogram.
+static void computeStats(Image img, struct imageStats* st) {
+  memset(st->hist, 0, sizeof(st->hist));
+  struct statsJob job = {img, PTHREAD_MUTEX_INITIALIZER, st->hist};
+  poolRows(img->height, (size_t)img->width, statsRows, &job);
+  pthread_mutex_destroy(&job.lock);
+  PIXMEM += (unsigned long)img->width * img->height;  // one access per pixel
+
+  int lo = 0, hi = 255;
+  while (lo < 255 && st->hist[lo] == 0) lo++;
+  while (hi > 0 && st->hist[hi] == 0) hi--;
+  if (lo > hi) lo = hi = 0;  // empty image
+  st->min = (uint8)lo;
+  st->max = (uint8)hi;
+  st->sum = 0;
+  for (int v = 1; v < 256; ++v) {
+    st->sum += (uint64_t)v * st->hist[v];
+  }
+}
+
+// Set *st to the statistics of img:  a copy of the cached ones if the
+// pixels did not change since they were computed.  (Views are not cached:
+// they are usually small, and any write to their owner would invalidate
+// them.)
+// The cache is allocated the first time stats are asked for, so images that
+// never need them do not carry it; if that allocation fails, the stats are
+// computed uncached.  Each cache has its own lock, held while it is
+// recomputed and copied:  a pass over one image does not hold up queries
+// on others, and concurrent queries on the same image wait for one pass.
+static void imageStats(Image img, struct imageStats* st) {
+  if (img->parent != NULL) {
+    computeStats(img, st);
+    return;
+  }
+  pthread_mutex_lock(&statsLock);
+  struct statsCache* cache = img->stats;
+  if (cache == NULL) {
+    cache = malloc(sizeof(*cache));
+    if (cache != NULL) {
+      pthread_mutex_init(&cache->lock, NULL);
+      atomic_store_explicit(&img->dirty, 1, memory_order_relaxed);
+      img->stats = cache;
+    }
+  }
+  pthread_mutex_unlock(&statsLock);
+  if (cache == NULL) {
+    computeStats(img, st);
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  if (atomic_load_explicit(&img->dirty, memory_order_relaxed)) {
+    // Clear the flag first:  writes racing with the pass mark it again
+    atomic_store_explicit(&img->dirty, 0, memory_order_relaxed);
+    computeStats(img, &cache->st);
+  }
+  *st = cache->st;
+  pthread_mutex_unlock(&cache->lock);
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (Both are 0 for an empty image.)
+/// The statistics of an image are cached until its pixels change,
+/// so repeated calls take constant time.
 void ImageStats(Image img, uint8* min, uint8* max) {  ///
   assert(img != NULL);
+  assert(min != NULL && max != NULL);
 
-  uint8 first_pixel = ImageGetPixel(img, 0, 0);
-  *min = first_pixel;
-  *max = first_pixel;
-
-  for (int i = 1; i < img->width * img->height; ++i) {
-    PIXMEM += 1;
+  struct imageStats st;
+  imageStats(img, &st);
+  *min = st.min;
+  *max = st.max;
+}
 
-    uint8 pixel = img->pixel[i];
+/// Pixel histogram
+/// On return, hist[v] is the number of pixels of img with level v,
+/// for every v in [0, 255].
+/// Cached like ImageStats.
+void ImageHistogram(Image img, uint64_t hist[256]) {  ///
+  assert(img != NULL);
+  assert(hist != NULL);
 
-    if (pixel < *min) {
-      *min = pixel;
-    } else if (pixel > *max) {
-      *max = pixel;
-    }
-  }
+  struct imageStats st;
+  imageStats(img, &st);
+  memcpy(hist, st.hist, sizeof(st.hist));
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -368,7 +1305,7 @@ int ImageValidRect(Image img, int x, int y, int w, int h) {  ///
   assert(w >= 0);
   assert(h >= 0);
 
-  return ImageValidPos(img, x, y) && ImageValidPos(img, x + w, y + h);
+  return (0 <= x && x <= img->width - w) && (0 <= y && y <= img->height - h);
 }
 
 /// Pixel get & set operations
@@ -380,10 +1317,10 @@ int ImageValidRect(Image img, int x, int y, int w, int h) {  ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel.
-// The returned index must satisfy (0 <= index < img->width*img->height)
+// The returned index must satisfy (0 <= index < img->stride*img->height)
 static inline int G(Image img, int x, int y) {
-  int index = (y * img->width) + x;
-  assert(0 <= index && index < img->width * img->height);
+  int index = (y * img->stride) + x;
+  assert(0 <= index && index < img->stride * img->height);
   return index;
 }
 
@@ -401,6 +1338,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) {  ///
   assert(ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
+  touch(img);
 }
 
 /// Pixel transformations
@@ -410,36 +1348,191 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) {  ///
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
-/// Transform image to negative image.
-/// This transforms dark pixels to light pixels and vice-versa,
-/// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) {  ///
-  assert(img != NULL);
-
-  for (int i = 0; i < img->width * img->height; ++i) {
-    PIXMEM += 1;
-    img->pixel[i] = img->maxval - img->pixel[i];
+// Table-driven point operations
+//
+// Every pixel transformation above is a function of the pixel level alone,
+// so it can be tabulated once in a 256-entry lookup table (LUT) and then
+// applied with a single load per pixel.  This removes the per-pixel branch
+// (ImageThreshold) and the per-pixel double arithmetic (ImageBrighten).
+//
+// On CPUs with SSSE3 or AVX2 (see simdLevel), the table is applied 16 or 32
+// pixels at a time:  the 256 entries are split into 16 sub-tables of 16
+// bytes, each sub-table is looked up with a byte shuffle indexed by the low
+// nibble, and the result is selected by comparing the high nibble.
+// Otherwise, a plain scalar loop is used.
+// The vector loops use aligned loads and stores; the rows of owned images
+// with padded strides are one aligned span, so no scalar head or tail is
+// left for them.
+
+#if SIMD_DISPATCH
+// Apply lut to n bytes of p, 32 at a time.  Returns number of bytes done.
+// Requires: p aligned to 32 bytes.
+__attribute__((target("avx2"))) static size_t applyLUTAvx2(uint8* p, size_t n, const uint8 lut[256]) {
+  __m256i tbl[16];
+  for (int i = 0; i < 16; ++i) {
+    tbl[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + 16 * i)));
   }
+  const __m256i lo_mask = _mm256_set1_epi8(0x0f);
+  size_t k = 0;
+  for (; k + 32 <= n; k += 32) {
+    __m256i v = _mm256_load_si256((const __m256i*)(p + k));
+    __m256i lo = _mm256_and_si256(v, lo_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lo_mask);
+    __m256i r = _mm256_setzero_si256();
+    for (int i = 0; i < 16; ++i) {
+      __m256i sel = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)i));
+      r = _mm256_blendv_epi8(r, _mm256_shuffle_epi8(tbl[i], lo), sel);
+    }
+    _mm256_store_si256((__m256i*)(p + k), r);
+  }
+  return k;
 }
 
-/// Apply threshold to image.
-/// Transform all pixels with level<thr to black (0) and
-/// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) {  ///
-  assert(img != NULL);
-
-  for (int i = 0; i < img->width * img->height; ++i) {
-    PIXMEM += 1;
-    uint8 pixel = img->pixel[i];
-
-    if (pixel >= thr) {
-      img->pixel[i] = img->maxval;
-    } else {
-      img->pixel[i] = 0;
+// Apply lut to n bytes of p, 16 at a time.  Returns number of bytes done.
+// Requires: p aligned to 16 bytes.
+__attribute__((target("ssse3"))) static size_t applyLUTSsse3(uint8* p, size_t n, const uint8 lut[256]) {
+  __m128i tbl[16];
+  for (int i = 0; i < 16; ++i) {
+    tbl[i] = _mm_loadu_si128((const __m128i*)(lut + 16 * i));
+  }
+  const __m128i lo_mask = _mm_set1_epi8(0x0f);
+  size_t k = 0;
+  for (; k + 16 <= n; k += 16) {
+    __m128i v = _mm_load_si128((const __m128i*)(p + k));
+    __m128i lo = _mm_and_si128(v, lo_mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), lo_mask);
+    __m128i r = _mm_setzero_si128();
+    for (int i = 0; i < 16; ++i) {
+      __m128i sel = _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)i));
+      r = _mm_or_si128(r, _mm_and_si128(sel, _mm_shuffle_epi8(tbl[i], lo)));
     }
+    _mm_store_si128((__m128i*)(p + k), r);
+  }
+  return k;
+}
+#endif
+
+// Apply lut to the n bytes of p:  scalar up to the first byte aligned for
+// the vector kernel of this CPU, vector from there, and scalar again for
+// the remaining bytes, if any.
+static void applyLUTSpan(uint8* p, size_t n, const uint8 lut[256]) {
+  int level = simdLevel();
+  size_t vec = level == SIMD_AVX2 ? 32 : level == SIMD_SSSE3 ? 16 : 1;
+  size_t head = (size_t)(-(uintptr_t)p & (vec - 1));
+  if (head > n) head = n;
+  for (size_t k = 0; k < head; ++k) {
+    p[k] = lut[p[k]];
+  }
+  size_t k = head;
+#if SIMD_DISPATCH
+  if (level == SIMD_AVX2) {
+    k += applyLUTAvx2(p + head, n - head, lut);
+  } else if (level == SIMD_SSSE3) {
+    k += applyLUTSsse3(p + head, n - head, lut);
+  }
+#endif
+  for (; k < n; ++k) {
+    p[k] = lut[p[k]];
+  }
+}
+
+struct lutJob {
+  Image img;
+  const uint8* lut;
+};
+
+// Apply the table of job to rows [y0, y1).
+static void applyLUTRows(void* arg, int y0, int y1) {
+  struct lutJob* job = arg;
+  Image img = job->img;
+  // Rows of owned images, padding included, form a single contiguous (and,
+  // with padded strides, aligned) span; views need one span per row
+  if (img->parent == NULL) {
+    applyLUTSpan(img->pixel + (size_t)y0 * img->stride, (size_t)(y1 - y0) * img->stride, job->lut);
+    return;
+  }
+  for (int y = y0; y < y1; ++y) {
+    applyLUTSpan(img->pixel + (size_t)y * img->stride, (size_t)img->width, job->lut);
   }
 }
 
+/// Apply a lookup table to every pixel.
+/// Each pixel level v is replaced by lut[v].
+/// Requires: all entries of lut must be <= maxval.
+void ImageApplyLUT(Image img, const uint8 lut[256]) {  ///
+  assert(img != NULL);
+  assert(lut != NULL);
+
+  struct lutJob job = {img, lut};
+  poolRows(img->height, (size_t)img->width, applyLUTRows, &job);
+  touch(img);
+  PIXMEM += (unsigned long)img->width * img->height;  // one access per pixel
+}
+
+// Tables of the pixel transformations for a given maxval.
+// (Shared by the Image and the ImageStream versions.)
+
+static void negativeLUT(int maxval, uint8 lut[256]) {
+  for (int v = 0; v < 256; ++v) {
+    lut[v] = (uint8)(maxval - v);
+  }
+}
+
+static void thresholdLUT(int maxval, uint8 thr, uint8 lut[256]) {
+  for (int v = 0; v < 256; ++v) {
+    lut[v] = v >= thr ? maxval : 0;
+  }
+}
+
+static void brightenLUT(int maxval, double factor, uint8 lut[256]) {
+  // Only 256 distinct products exist, so compute each of them once
+  for (int v = 0; v < 256; ++v) {
+    double new_color = v * factor;
+    lut[v] = new_color >= maxval ? maxval : (uint8)round(new_color);
+  }
+}
+
+/// Fill lut with the table of ImageNegative for img.
+void ImageNegativeLUT(Image img, uint8 lut[256]) {  ///
+  assert(img != NULL);
+  negativeLUT(img->maxval, lut);
+}
+
+/// Fill lut with the table of ImageThreshold for img.
+void ImageThresholdLUT(Image img, uint8 thr, uint8 lut[256]) {  ///
+  assert(img != NULL);
+  thresholdLUT(img->maxval, thr, lut);
+}
+
+/// Fill lut with the table of ImageBrighten for img.
+void ImageBrightenLUT(Image img, double factor, uint8 lut[256]) {  ///
+  assert(img != NULL);
+  assert(factor >= 0.0);
+  brightenLUT(img->maxval, factor, lut);
+}
+
+/// Transform image to negative image.
+/// This transforms dark pixels to light pixels and vice-versa,
+/// resulting in a "photographic negative" effect.
+void ImageNegative(Image img) {  ///
+  assert(img != NULL);
+
+  uint8 lut[256];
+  ImageNegativeLUT(img, lut);
+  ImageApplyLUT(img, lut);
+}
+
+/// Apply threshold to image.
+/// Transform all pixels with level<thr to black (0) and
+/// all pixels with level>=thr to white (maxval).
+void ImageThreshold(Image img, uint8 thr) {  ///
+  assert(img != NULL);
+
+  uint8 lut[256];
+  ImageThresholdLUT(img, thr, lut);
+  ImageApplyLUT(img, lut);
+}
+
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
@@ -448,16 +1541,68 @@ void ImageBrighten(Image img, double factor) {  ///
   assert(img != NULL);
   assert(factor >= 0.0);
 
-  for (int i = 0; i < img->width * img->height; ++i) {
-    PIXMEM += 1;
-    int new_color = round(img->pixel[i] * factor);
+  uint8 lut[256];
+  ImageBrightenLUT(img, factor, lut);
+  ImageApplyLUT(img, lut);
+}
 
-    if (new_color > img->maxval) {
-      new_color = img->maxval;
+/// Equalize the histogram of image.
+/// Spread the gray levels of img over [0, maxval] so that their cumulative
+/// distribution becomes (nearly) linear, which raises the contrast of the
+/// levels that occur most.
+/// The histogram comes from the statistics cache (see ImageStats), and the
+/// result is applied as a single lookup table pass.
+void ImageEqualize(Image img) {  ///
+  assert(img != NULL);
+
+  struct imageStats st;
+  imageStats(img, &st);
+  uint64_t n = (uint64_t)img->width * img->height;
+  uint64_t below = st.hist[st.min];  // pixels mapped to 0
+  uint8 lut[256];
+  uint64_t cdf = 0;
+  for (int v = 0; v < 256; ++v) {
+    cdf += st.hist[v];
+    if (n == below) {
+      lut[v] = (uint8)min(v, img->maxval);  // at most one level: nothing to spread
+    } else if (cdf <= below) {
+      lut[v] = 0;
+    } else {
+      lut[v] = (uint8)round((double)(cdf - below) * img->maxval / (double)(n - below));
     }
+  }
+  ImageApplyLUT(img, lut);
+}
+
+/// Apply threshold to image, at the level chosen by Otsu's method.
+/// The threshold thr maximizes the between-class variance of the two
+/// classes of pixels (level<thr and level>=thr), which best separates the
+/// dark and light pixels of bimodal images.  Then the image is thresholded
+/// as in ImageThreshold, with a single lookup table pass.
+/// Returns thr.  (An image with a single level is turned white.)
+uint8 ImageThresholdOtsu(Image img) {  ///
+  assert(img != NULL);
 
-    img->pixel[i] = (uint8)new_color;
+  struct imageStats st;
+  imageStats(img, &st);
+  double n = (double)img->width * img->height;
+  uint8 thr = st.max;
+  double best = 0.0;
+  uint64_t n0 = 0;    // pixels of level < t
+  uint64_t sum0 = 0;  // sum of their levels
+  for (int t = st.min + 1; t <= st.max; ++t) {
+    n0 += st.hist[t - 1];
+    sum0 += (uint64_t)(t - 1) * st.hist[t - 1];
+    double w0 = (double)n0, w1 = n - w0;
+    double d = (double)sum0 / w0 - (double)(st.sum - sum0) / w1;
+    double var = w0 * w1 * d * d;
+    if (var > best) {
+      best = var;
+      thr = (uint8)t;
+    }
   }
+  ImageThreshold(img, thr);
+  return thr;
 }
 
 /// Geometric transformations
@@ -473,6 +1618,136 @@ void ImageBrighten(Image img, double factor) {  ///
 // Implementation hint:
 // Call ImageCreate whenever you need a new image!
 
+// Cache-blocked transposition
+//
+// All 90 degree rotations are transpositions in disguise:  reading the
+// source rows bottom-up, or writing the destination rows bottom-up, turns a
+// transpose into a clockwise or an anti-clockwise rotation.  So a single
+// kernel, taking signed row strides, implements all of them.
+//
+// A naive transpose reads rows and writes columns, so every destination
+// write touches a different cache line (and page) once the image is larger
+// than the cache.  Instead, the image is processed in TILE x TILE tiles,
+// small enough that both source and destination tiles stay in L1, and each
+// tile is transposed in 16x16 blocks held in vector registers.
+
+#define TILE 64
+
+#if defined(__SSE2__)
+// Transpose a 16x16 block: dst[x*dstride + y] = src[y*sstride + x].
+// Four rounds of interleaving, each doubling the width of the elements
+// being interleaved (8, 16, 32 and 64 bits).
+static void transpose16x16(const uint8* src, ptrdiff_t sstride, uint8* dst, ptrdiff_t dstride) {
+  __m128i a[16], b[16];
+  for (int i = 0; i < 16; ++i) {
+    a[i] = _mm_loadu_si128((const __m128i*)(src + i * sstride));
+  }
+  // b[h*8 + p] = rows 2p,2p+1 interleaved, columns 8h..8h+7
+  for (int p = 0; p < 8; ++p) {
+    b[p] = _mm_unpacklo_epi8(a[2 * p], a[2 * p + 1]);
+    b[8 + p] = _mm_unpackhi_epi8(a[2 * p], a[2 * p + 1]);
+  }
+  // a[h*8 + c*4 + q] = rows 4q..4q+3, columns 8h+4c..8h+4c+3
+  for (int h = 0; h < 2; ++h) {
+    for (int q = 0; q < 4; ++q) {
+      a[h * 8 + q] = _mm_unpacklo_epi16(b[h * 8 + 2 * q], b[h * 8 + 2 * q + 1]);
+      a[h * 8 + 4 + q] = _mm_unpackhi_epi16(b[h * 8 + 2 * q], b[h * 8 + 2 * q + 1]);
+    }
+  }
+  // b[h*8 + c*4 + d*2 + s] = rows 8s..8s+7, columns 8h+4c+2d..8h+4c+2d+1
+  for (int g = 0; g < 4; ++g) {
+    for (int s = 0; s < 2; ++s) {
+      b[g * 4 + s] = _mm_unpacklo_epi32(a[g * 4 + 2 * s], a[g * 4 + 2 * s + 1]);
+      b[g * 4 + 2 + s] = _mm_unpackhi_epi32(a[g * 4 + 2 * s], a[g * 4 + 2 * s + 1]);
+    }
+  }
+  // Column 2g (and 2g+1) is now rows 0..15 in full
+  for (int g = 0; g < 8; ++g) {
+    _mm_storeu_si128((__m128i*)(dst + (2 * g) * dstride), _mm_unpacklo_epi64(b[2 * g], b[2 * g + 1]));
+    _mm_storeu_si128((__m128i*)(dst + (2 * g + 1) * dstride), _mm_unpackhi_epi64(b[2 * g], b[2 * g + 1]));
+  }
+}
+#endif
+
+// Transpose a w x h tile: dst[x*dstride + y] = src[y*sstride + x].
+static void transposeTile(const uint8* src, ptrdiff_t sstride, uint8* dst, ptrdiff_t dstride, int w, int h) {
+  int y = 0;
+#if defined(__SSE2__)
+  for (; y + 16 <= h; y += 16) {
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+      transpose16x16(src + y * sstride + x, sstride, dst + x * dstride + y, dstride);
+    }
+    // Right edge of the tile
+    for (int yy = y; yy < y + 16; ++yy) {
+      for (int xx = x; xx < w; ++xx) {
+        dst[xx * dstride + yy] = src[yy * sstride + xx];
+      }
+    }
+  }
+#endif
+  // Bottom edge of the tile (or the whole tile without SSE2)
+  for (; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      dst[x * dstride + y] = src[y * sstride + x];
+    }
+  }
+}
+
+// Rows of a raster to be copied (or transposed) to another raster.
+// Strides may be negative, to walk the source or destination bottom-up.
+struct rasterJob {
+  const uint8* src;
+  ptrdiff_t sstride;
+  uint8* dst;
+  ptrdiff_t dstride;
+  int w, h;
+};
+
+// Transpose rows of tiles [t0, t1) of job.
+static void transposeTileRows(void* arg, int t0, int t1) {
+  struct rasterJob* job = arg;
+  int w = job->w;
+  int h = job->h;
+  for (int y = t0 * TILE; y < h && y < t1 * TILE; y += TILE) {
+    for (int x = 0; x < w; x += TILE) {
+      transposeTile(job->src + y * job->sstride + x, job->sstride, job->dst + x * job->dstride + y, job->dstride,
+                    min(TILE, w - x), min(TILE, h - y));
+    }
+  }
+}
+
+// Transpose a w x h raster, tile by tile.
+// Each row of tiles is an independent task.
+static void transposeRaster(const uint8* src, ptrdiff_t sstride, uint8* dst, ptrdiff_t dstride, int w, int h) {
+  struct rasterJob job = {src, sstride, dst, dstride, w, h};
+  poolRows((h + TILE - 1) / TILE, (size_t)w * TILE, transposeTileRows, &job);
+  PIXMEM += 2 * (unsigned long)w * h;  // one load and one store per pixel
+}
+
+/// Transpose an image.
+/// Returns the image reflected about its main diagonal:
+/// pixel (x,y) of img becomes pixel (y,x) of the result.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTranspose(Image img) {  ///
+  assert(img != NULL);
+
+  Image new_img = newImage(img->height, img->width, img->maxval);
+
+  // newImage() already sets errno/errCause
+  if (new_img == NULL) {
+    return NULL;
+  }
+
+  transposeRaster(img->pixel, img->stride, new_img->pixel, new_img->stride, img->width, img->height);
+
+  return new_img;
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -484,20 +1759,128 @@ void ImageBrighten(Image img, double factor) {  ///
 Image ImageRotate(Image img) {  ///
   assert(img != NULL);
 
-  Image new_img = ImageCreate(img->height, img->width, img->maxval);
+  Image new_img = newImage(img->height, img->width, img->maxval);
 
-  // ImageCreate() already sets errno/errCause
+  // newImage() already sets errno/errCause
   if (new_img == NULL) {
     return NULL;
   }
 
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(new_img, y, img->height - x - 1, pixel);
-    }
+  // Pixel (x,y) goes to (y, width-1-x): write the transpose bottom-up
+  uint8* last_row = new_img->pixel + (size_t)(new_img->height - 1) * new_img->stride;
+  transposeRaster(img->pixel, img->stride, last_row, -(ptrdiff_t)new_img->stride, img->width, img->height);
+
+  return new_img;
+}
+
+/// Rotate an image clockwise.
+/// Returns a version of the image rotated 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateCW(Image img) {  ///
+  assert(img != NULL);
+
+  Image new_img = newImage(img->height, img->width, img->maxval);
+
+  // newImage() already sets errno/errCause
+  if (new_img == NULL) {
+    return NULL;
   }
 
+  // Pixel (x,y) goes to (height-1-y, x): transpose the source read bottom-up
+  const uint8* last_row = img->pixel + (size_t)(img->height - 1) * img->stride;
+  transposeRaster(last_row, -(ptrdiff_t)img->stride, new_img->pixel, new_img->stride, img->width, img->height);
+
+  return new_img;
+}
+
+#if SIMD_DISPATCH
+// Reverse the first bytes of the n of src into dst, 32 at a time.
+// Returns number of bytes done.
+__attribute__((target("avx2"))) static int reverseRowAvx2(const uint8* src, uint8* dst, int n) {
+  // Reverse bytes within each 128-bit lane, then swap the two lanes
+  const __m256i rev32 = _mm256_broadcastsi128_si256(
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i)), rev32);
+    _mm256_storeu_si256((__m256i*)(dst + n - 32 - i), _mm256_permute2x128_si256(v, v, 0x01));
+  }
+  return i;
+}
+
+// Same as reverseRowAvx2, 16 bytes at a time.
+__attribute__((target("ssse3"))) static int reverseRowSsse3(const uint8* src, uint8* dst, int n) {
+  const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + n - 16 - i), _mm_shuffle_epi8(v, rev));
+  }
+  return i;
+}
+#endif
+
+// Copy the n bytes of src to dst in reverse order.
+static void reverseRow(const uint8* src, uint8* dst, int n) {
+  int i = 0;
+#if SIMD_DISPATCH
+  int level = simdLevel();
+  if (level == SIMD_AVX2) {
+    i = reverseRowAvx2(src, dst, n);
+  } else if (level == SIMD_SSSE3) {
+    i = reverseRowSsse3(src, dst, n);
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[n - 1 - i] = src[i];
+  }
+}
+
+// Copy rows [y0, y1) of job, reversed.
+static void reverseRows(void* arg, int y0, int y1) {
+  struct rasterJob* job = arg;
+  for (int y = y0; y < y1; ++y) {
+    reverseRow(job->src + y * job->sstride, job->dst + y * job->dstride, job->w);
+  }
+}
+
+// Copy rows [y0, y1) of job.
+static void copyRows(void* arg, int y0, int y1) {
+  struct rasterJob* job = arg;
+  for (int y = y0; y < y1; ++y) {
+    memcpy(job->dst + y * job->dstride, job->src + y * job->sstride, job->w);
+  }
+}
+
+/// Rotate an image by 180 degrees.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) {  ///
+  assert(img != NULL);
+
+  Image new_img = newImage(img->width, img->height, img->maxval);
+
+  // newImage() already sets errno/errCause
+  if (new_img == NULL) {
+    return NULL;
+  }
+
+  // No transposition needed: row y is row height-1-y reversed.
+  // Rows are streamed sequentially, so no tiling is needed either.
+  int w = img->width;
+  int h = img->height;
+  uint8* last_row = new_img->pixel + (size_t)(h - 1) * new_img->stride;
+  struct rasterJob job = {img->pixel, img->stride, last_row, -(ptrdiff_t)new_img->stride, w, h};
+  poolRows(h, (size_t)w, reverseRows, &job);
+  PIXMEM += 2 * (unsigned long)w * h;  // one load and one store per pixel
+
   return new_img;
 }
 
@@ -511,145 +1894,1617 @@ Image ImageRotate(Image img) {  ///
 Image ImageMirror(Image img) {  ///
   assert(img != NULL);
 
-  Image new_img = ImageCreate(img->width, img->height, img->maxval);
+  Image new_img = newImage(img->width, img->height, img->maxval);
 
-  // ImageCreate() already sets errno/errCause
+  // newImage() already sets errno/errCause
   if (new_img == NULL) {
     return NULL;
   }
 
+  int w = img->width;
+  struct rasterJob job = {img->pixel, img->stride, new_img->pixel, new_img->stride, w, img->height};
+  poolRows(img->height, (size_t)w, reverseRows, &job);
+  PIXMEM += 2 * (unsigned long)w * img->height;  // one load and one store per pixel
+
+  return new_img;
+}
+
+/// Crop a rectangular subimage from img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCrop(Image img, int x, int y, int w, int h) {  ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, w, h));
+
+  Image new_img = newImage(w, h, img->maxval);
+
+  // newImage() already sets errno/errCause
+  if (new_img == NULL) {
+    return NULL;
+  }
+
+  // Each row of the rectangle is contiguous in the source
+  struct rasterJob job = {img->pixel + G(img, x, y), img->stride, new_img->pixel, new_img->stride, w, h};
+  poolRows(h, (size_t)w, copyRows, &job);
+  PIXMEM += 2 * (unsigned long)w * h;  // one load and one store per pixel
+
+  assert(new_img->width == w && new_img->height == h);
+
+  return new_img;
+}
+
+/// Operations on two images
+
+// Whether the pixels of img2 may overlap the region of img1 at (x, y) that
+// img2 would cover.  That only happens if both view the same image (and so
+// have the same stride); then the spans of addresses are compared, which is
+// conservative when the rows of one fall between the rows of the other.
+static int overlaps(Image img1, int x, int y, Image img2) {
+  if (img2->width == 0 || img2->height == 0 || owner(img1) != owner(img2)) {
+    return 0;
+  }
+  assert(img1->stride == img2->stride);
+  const uint8* dst = img1->pixel + G(img1, x, y);
+  const uint8* src = img2->pixel;
+  size_t span = (size_t)(img2->height - 1) * img1->stride + img2->width;
+  return dst < src + span && src < dst + span;
+}
+
+/// Paste an image into a larger image.
+/// Paste img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// img2 may view pixels of img1, even inside that region:  the result is
+/// the same as if img2 had been copied first.
+void ImagePaste(Image img1, int x, int y, Image img2) {  ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+
+  int w = img2->width;
+  int h = img2->height;
+  uint8* dst = img1->pixel + G(img1, x, y);
+  if (overlaps(img1, x, y, img2)) {
+    // Copy serially, in the order of rows that reads each source row before
+    // it is overwritten (memmove handles the overlap within a row).
+    size_t stride = img1->stride;
+    if (dst < img2->pixel) {
+      for (int r = 0; r < h; ++r) {
+        memmove(dst + r * stride, img2->pixel + r * stride, w);
+      }
+    } else {
+      for (int r = h - 1; r >= 0; --r) {
+        memmove(dst + r * stride, img2->pixel + r * stride, w);
+      }
+    }
+  } else {
+    struct rasterJob job = {img2->pixel, img2->stride, dst, img1->stride, w, h};
+    poolRows(h, (size_t)w, copyRows, &job);
+  }
+  touch(img1);
+  PIXMEM += 2 * (unsigned long)w * h;  // one load and one store per pixel
+}
+
+// Blending
+//
+// The blended level depends only on the pair of levels (pixel1, pixel2), and
+// there are only 256*256 such pairs.  So, for large regions, all results are
+// computed once into a 64 KiB table (with exactly the same double arithmetic
+// and rounding as the per-pixel formula), and each pixel then costs a single
+// table load instead of two multiplications, a rounding and a clamp.
+// A fixed-point formula would be cheaper still, but could not reproduce the
+// double rounding exactly for every alpha (e.g., 0.33*50 is a tie).
+
+// Regions smaller than this are blended directly, without a table
+#define BLEND_TABLE_MIN_PIXELS (256 * 256)
+
+// Blend level pixel2 into level pixel1 with the given alpha, saturating.
+static inline uint8 blendPixel(int pixel1, int pixel2, double alpha, int maxval) {
+  int blended_pixel = round(pixel1 * (1 - alpha) + pixel2 * alpha);
+
+  if (blended_pixel > maxval) {
+    blended_pixel = maxval;
+  } else if (blended_pixel < 0) {
+    blended_pixel = 0;
+  }
+  return (uint8)blended_pixel;
+}
+
+// Allocate and fill the table of blendPixel results, indexed by
+// (pixel1 << 8 | pixel2).  Returns NULL if allocation fails (then callers
+// blend directly).
+static uint8* newBlendTable(double alpha, int maxval) {
+  uint8* table = malloc(256 * 256);
+  if (table == NULL) return NULL;
+  for (int pixel1 = 0; pixel1 < 256; ++pixel1) {
+    for (int pixel2 = 0; pixel2 < 256; ++pixel2) {
+      table[pixel1 << 8 | pixel2] = blendPixel(pixel1, pixel2, alpha, maxval);
+    }
+  }
+  return table;
+}
+
+// Blend the n levels of src into dst, using table if not NULL.
+static void blendRow(uint8* dst, const uint8* src, int n, double alpha, int maxval, const uint8* table) {
+  if (table != NULL) {
+    for (int i = 0; i < n; ++i) {
+      dst[i] = table[dst[i] << 8 | src[i]];
+    }
+  } else {
+    for (int i = 0; i < n; ++i) {
+      dst[i] = blendPixel(dst[i], src[i], alpha, maxval);
+    }
+  }
+}
+
+// Blend of one layer into rows of an image
+struct blendJob {
+  uint8* dst;
+  size_t dstride;
+  const uint8* src;
+  size_t sstride;
+  int w;
+  double alpha;
+  int maxval;
+  const uint8* table;
+};
+
+// Blend rows [y0, y1) of job.
+static void blendRows(void* arg, int y0, int y1) {
+  struct blendJob* job = arg;
+  for (int y = y0; y < y1; ++y) {
+    blendRow(job->dst + y * job->dstride, job->src + y * job->sstride, job->w, job->alpha, job->maxval, job->table);
+  }
+}
+
+// Size of the spans blended through a buffer by blendOverlapping
+#define BLEND_CHUNK 4096
+
+// Blend h rows of job serially, when its source overlaps its destination.
+// Pixels are visited in the order of addresses that never overwrites a
+// source pixel before it is read:  ascending if the destination starts
+// before the source, descending otherwise.  Within a row the two may still
+// overlap, so each span of the source is copied to a buffer first.
+static void blendOverlapping(struct blendJob* job, int h) {
+  uint8 buf[BLEND_CHUNK];
+  int descending = job->dst > job->src;
+  int w = job->w;
+  for (int r = 0; r < h; ++r) {
+    int y = descending ? h - 1 - r : r;
+    for (int c = 0; c < w; c += BLEND_CHUNK) {
+      int n = min(BLEND_CHUNK, w - c);
+      int i = descending ? w - c - n : c;
+      memcpy(buf, job->src + y * job->sstride + i, n);
+      blendRow(job->dst + y * job->dstride + i, buf, n, job->alpha, job->maxval, job->table);
+    }
+  }
+}
+
+/// Blend an image into a larger image.
+/// Blend img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// img2 may view pixels of img1, even inside that region:  the result is
+/// the same as if img2 had been copied first.
+/// alpha usually is in [0.0, 1.0], but values outside that interval
+/// may provide interesting effects.  Over/underflows should saturate.
+void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {  ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+
+  int w = img2->width;
+  int h = img2->height;
+  uint8* table = NULL;
+  if ((long)w * h >= BLEND_TABLE_MIN_PIXELS) {
+    table = newBlendTable(alpha, img1->maxval);
+  }
+
+  struct blendJob job = {img1->pixel + G(img1, x, y), img1->stride, img2->pixel, img2->stride,
+                         w, alpha, img1->maxval, table};
+  if (overlaps(img1, x, y, img2)) {
+    blendOverlapping(&job, h);
+  } else {
+    poolRows(h, (size_t)w, blendRows, &job);
+  }
+  touch(img1);
+  PIXMEM += 3 * (unsigned long)w * h;  // two loads and one store per pixel
+
+  free(table);
+}
+
+// Blend of several layers into rows [ymin, ...) of an image
+struct blendManyJob {
+  Image img1;
+  int n;
+  Image* layers;
+  const int *xs, *ys;
+  const double* alphas;
+  uint8** tables;  // may be NULL
+  int ymin;
+};
+
+// Blend all layers of job into rows ymin+[r0, r1) of the image.
+static void blendManyRows(void* arg, int r0, int r1) {
+  struct blendManyJob* job = arg;
+  Image img1 = job->img1;
+  for (int y = job->ymin + r0; y < job->ymin + r1; ++y) {
+    uint8* row = img1->pixel + (size_t)y * img1->stride;
+    for (int i = 0; i < job->n; ++i) {
+      Image layer = job->layers[i];
+      int y0 = y - job->ys[i];
+      if (y0 < 0 || y0 >= layer->height) continue;
+      blendRow(row + job->xs[i], layer->pixel + (size_t)y0 * layer->stride, layer->width,
+               job->alphas[i], img1->maxval, job->tables == NULL ? NULL : job->tables[i]);
+    }
+  }
+}
+
+/// Blend several images into a larger image, in a single pass.
+/// The result is the same as calling ImageBlend(img1, xs[i], ys[i],
+/// layers[i], alphas[i]) for i = 0, 1, ..., n-1, in that order, but img1
+/// is swept only once:  each of its rows is blended with all layers that
+/// cover it while it is in cache.
+/// (If a layer views pixels of img1, the layers are blended one at a time.)
+/// This modifies img1 in-place.  It never fails.
+/// Requires: each layers[i] must fit inside img1 at position (xs[i], ys[i]).
+void ImageBlendMany(Image img1, int n, Image layers[], const int xs[], const int ys[], const double alphas[]) {  ///
+  assert(img1 != NULL);
+  assert(n >= 0);
+  for (int i = 0; i < n; ++i) {
+    assert(layers[i] != NULL);
+    assert(ImageValidRect(img1, xs[i], ys[i], layers[i]->width, layers[i]->height));
+  }
+
+  // A layer viewing the pixels of img1 must see the blends of the layers
+  // before it, so then they are blended one at a time.
+  for (int i = 0; i < n; ++i) {
+    if (owner(layers[i]) == owner(img1)) {
+      for (int j = 0; j < n; ++j) {
+        ImageBlend(img1, xs[j], ys[j], layers[j], alphas[j]);
+      }
+      return;
+    }
+  }
+
+  // Build a table for each large layer, shared by layers with equal alpha.
+  // If memory is short, layers are simply blended without tables.
+  uint8** tables = calloc(n > 0 ? n : 1, sizeof(uint8*));
+  int ymin = img1->height, ymax = 0;
+  for (int i = 0; i < n; ++i) {
+    ymin = min(ymin, ys[i]);
+    ymax = max(ymax, ys[i] + layers[i]->height);
+    if (tables == NULL || (long)layers[i]->width * layers[i]->height < BLEND_TABLE_MIN_PIXELS) {
+      continue;
+    }
+    for (int j = 0; j < i && tables[i] == NULL; ++j) {
+      if (alphas[j] == alphas[i]) tables[i] = tables[j];
+    }
+    if (tables[i] == NULL) {
+      tables[i] = newBlendTable(alphas[i], img1->maxval);
+    }
+  }
+
+  struct blendManyJob job = {img1, n, layers, xs, ys, alphas, tables, ymin};
+  poolRows(max(0, ymax - ymin), (size_t)img1->width, blendManyRows, &job);
+  touch(img1);
+  for (int i = 0; i < n; ++i) {
+    PIXMEM += 3 * (unsigned long)layers[i]->width * layers[i]->height;  // two loads and one store per pixel
+  }
+
+  // Free each distinct table once
+  for (int i = 0; tables != NULL && i < n; ++i) {
+    int shared = 0;
+    for (int j = 0; j < i && !shared; ++j) {
+      shared = tables[j] == tables[i];
+    }
+    if (!shared) free(tables[i]);
+  }
+  free(tables);
+}
+
+// Subimage comparison
+//
+// Rows are compared whole, 16 or 32 bytes at a time, stopping at the first
+// difference.  Before the rows, the last pixel is compared alone:  it is a
+// cheap test that rejects most windows that merely share the top rows with
+// the subimage (as happens when searching uniform regions).
+// PIXCMP counts bytes compared, up to and including the first difference,
+// so it still counts pixel comparisons.
+
+#if SIMD_DISPATCH
+// Index of the first difference between the n bytes of a and b, looking
+// 32 bytes at a time, or the number of bytes found equal that way.
+__attribute__((target("avx2"))) static int firstDiffAvx2(const uint8* a, const uint8* b, int n) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                   _mm256_loadu_si256((const __m256i*)(b + i)));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+    if (mask != 0xffffffffu) return i + __builtin_ctz(~mask);
+  }
+  return i;
+}
+#endif
+
+// Index of the first difference between the n bytes of a and b, or n if
+// they are equal.
+static int firstDiff(const uint8* a, const uint8* b, int n) {
+  int i = 0;
+#if SIMD_DISPATCH
+  if (n >= 32 && simdLevel() == SIMD_AVX2) {
+    i = firstDiffAvx2(a, b, n);  // (a difference found there is found again below)
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+    unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+    if (mask != 0xffffu) return i + __builtin_ctz(~mask);
+  }
+#endif
+  for (; i < n; ++i) {
+    if (a[i] != b[i]) return i;
+  }
+  return n;
+}
+
+// Check if img2 matches img1 at (x, y), adding the number of bytes
+// compared to *ncmp.  (No global counters, so pool tasks may use it.)
+static int matchAt(Image img1, int x, int y, Image img2, unsigned long* ncmp) {
+  int w = img2->width, h = img2->height;
+  if (w == 0 || h == 0) return 1;
+  const uint8* p1 = img1->pixel + (size_t)y * img1->stride + x;
+  const uint8* p2 = img2->pixel;
+
+  *ncmp += 1;
+  if (p1[(size_t)(h - 1) * img1->stride + w - 1] != p2[(size_t)(h - 1) * img2->stride + w - 1]) {
+    return 0;
+  }
+  for (int y0 = 0; y0 < h; ++y0) {
+    int d = firstDiff(p1 + (size_t)y0 * img1->stride, p2 + (size_t)y0 * img2->stride, w);
+    if (d < w) {
+      *ncmp += (unsigned long)d + 1;
+      return 0;
+    }
+    *ncmp += (unsigned long)w;
+  }
+  return 1;
+}
+
+/// Compare an image to a subimage of a larger image.
+/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+/// Requires: img2 must fit inside img1 at pos (x, y).
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) {  ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidPos(img1, x, y));
+  assert(x + img2->width <= img1->width && y + img2->height <= img1->height);
+
+  unsigned long ncmp = 0;
+  int match = matchAt(img1, x, y, img2, &ncmp);
+  PIXCMP += ncmp;
+  PIXMEM += 2 * ncmp;  // one access to each image per byte compared
+
+  return match;
+}
+
+// Rolling-hash search (Rabin-Karp in two dimensions)
+//
+// Each w x h window of img1 is summarized by a polynomial hash:  every row
+// of the window is hashed as a polynomial in HASH_BX of its w levels, and
+// the h row hashes as a polynomial in HASH_BY.  Sliding the window one
+// column right updates each row hash in O(1) (drop the leftmost level, add
+// the new rightmost one), and sliding it one row down updates the window
+// hash in O(1) too.  So all windows are hashed in O(W*H), and pixels are
+// only compared (with ImageMatchSubImage) where the hash equals the hash of
+// img2.  Hashes are computed modulo 2^64 (natural unsigned overflow); a
+// collision only costs an extra comparison, never a wrong answer.
+
+#define HASH_BX 0x9E3779B97F4A7C15ull
+#define HASH_BY 0xC2B2AE3D27D4EB4Full
+
+// b raised to the power e, modulo 2^64.
+static uint64_t hashPow(uint64_t b, int e) {
+  uint64_t r = 1;
+  for (; e > 0; e >>= 1, b *= b) {
+    if (e & 1) r *= b;
+  }
+  return r;
+}
+
+// Hash of the n levels of row p, as a polynomial in HASH_BX.
+static uint64_t hashRow(const uint8* p, int n) {
+  uint64_t hash = 0;
+  for (int i = 0; i < n; ++i) {
+    hash = hash * HASH_BX + p[i];
+  }
+  return hash;
+}
+
+/// Locate a subimage inside another image.
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Positions are scanned column by column (x outer, y inner), so the match
+/// found is the one with the smallest x, and then the smallest y.
+int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {  ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  int W = img1->width, H = img1->height;
+  int w = img2->width, h = img2->height;
+  if (w > W || h > H) return 0;
+
+  // Hash of the w levels starting at column x, for every row of img1
+  uint64_t* rowhash = w > 0 && h > 0 ? malloc((size_t)H * sizeof(uint64_t)) : NULL;
+  if (rowhash == NULL) {
+    // Empty subimage (or no memory): compare at every position
+    for (int x = 0; x <= W - w; ++x) {
+      for (int y = 0; y <= H - h; ++y) {
+        if (ImageMatchSubImage(img1, x, y, img2)) {
+          *px = x;
+          *py = y;
+          return 1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  uint64_t target = 0;
+  for (int y0 = 0; y0 < h; ++y0) {
+    target = target * HASH_BY + hashRow(img2->pixel + (size_t)y0 * img2->stride, w);
+  }
+  uint64_t topx = hashPow(HASH_BX, w - 1);  // weight of the leftmost level
+  uint64_t topy = hashPow(HASH_BY, h - 1);  // weight of the top row
+  for (int y = 0; y < H; ++y) {
+    rowhash[y] = hashRow(img1->pixel + (size_t)y * img1->stride, w);
+  }
+  PIXMEM += (unsigned long)w * (H + h);
+
+  int found = 0;
+  for (int x = 0; x <= W - w && !found; ++x) {
+    uint64_t hash = 0;
+    for (int y = 0; y < h; ++y) {
+      hash = hash * HASH_BY + rowhash[y];
+    }
+    for (int y = 0; y <= H - h; ++y) {
+      if (hash == target && ImageMatchSubImage(img1, x, y, img2)) {
+        *px = x;
+        *py = y;
+        found = 1;
+        break;
+      }
+      if (y < H - h) {
+        hash = (hash - rowhash[y] * topy) * HASH_BY + rowhash[y + h];
+      }
+    }
+    // Slide every row hash one column right
+    if (!found && x < W - w) {
+      for (int y = 0; y < H; ++y) {
+        const uint8* row = img1->pixel + (size_t)y * img1->stride;
+        rowhash[y] = (rowhash[y] - row[x] * topx) * HASH_BX + row[x + w];
+      }
+      PIXMEM += 2 * (unsigned long)H;
+    }
+  }
+
+  free(rowhash);
+  return found;
+}
+
+// Finding all matches
+//
+// ImageLocateAll uses the same hashes as ImageLocateSubImage, but scans
+// positions in raster order (row by row), which is kind to the cache, and
+// splits the rows of positions into bands, searched by the pool.
+// In each band it keeps the hash of the window at every x of the current
+// row;  moving to the next row rolls all of them at once, from the window
+// hashes of the row that leaves and of the row that enters the windows.
+// Hash hits are confirmed as in ImageMatchSubImage.
+//
+// In first-match mode, positions are ranked as ImageLocateSubImage scans
+// them (by x, then y), and the bands share the rank of the best match found
+// so far.  Each band skips every position ranked after it, so bands stop
+// early, and the result is the one the serial scan finds.
+
+struct locateBand {
+  struct locateJob* job;
+  int y0, y1;              // rows of positions [y0, y1)
+  uint64_t* colhash;       // window hashes at each x of the current row
+  uint64_t* out;           // window hashes of the leaving row
+  uint64_t* in;            // window hashes of the entering row
+  ImagePos* pos;           // matches found (all mode)
+  int count, capacity;
+  int failed;              // could not grow pos
+  unsigned long pixmem, pixcmp;
+};
+
+struct locateJob {
+  Image img1, img2;
+  uint64_t target, topx, topy;
+  int first;
+  atomic_long best;        // first mode: rank x*rows+y of the best match so far
+  struct locateBand* bands;
+};
+
+// Hashes of the windows of width w of row (width W), for x in [0, W-w].
+static void hashWindows(const uint8* row, int W, int w, uint64_t topx, uint64_t* out) {
+  uint64_t hash = hashRow(row, w);
+  out[0] = hash;
+  for (int x = 1; x <= W - w; ++x) {
+    hash = (hash - row[x - 1] * topx) * HASH_BX + row[x - 1 + w];
+    out[x] = hash;
+  }
+}
+
+// Search band number i of job (a pool task).
+static void locateBandRun(void* arg, int i) {
+  struct locateJob* job = arg;
+  struct locateBand* b = &job->bands[i];
+  Image img1 = job->img1, img2 = job->img2;
+  int W = img1->width, w = img2->width, h = img2->height;
+  int nx = W - w + 1;
+  long rows = img1->height - h + 1;
+
+  for (int x = 0; x < nx; ++x) {
+    b->colhash[x] = 0;
+  }
+  for (int y = b->y0; y < b->y0 + h; ++y) {
+    hashWindows(img1->pixel + (size_t)y * img1->stride, W, w, job->topx, b->in);
+    for (int x = 0; x < nx; ++x) {
+      b->colhash[x] = b->colhash[x] * HASH_BY + b->in[x];
+    }
+  }
+  b->pixmem += (unsigned long)W * h;
+
+  for (int y = b->y0; y < b->y1 && !b->failed; ++y) {
+    long best = job->first ? atomic_load_explicit(&job->best, memory_order_relaxed) : LONG_MAX;
+    if (y >= best) break;  // every remaining position ranks after the best
+    for (int x = 0; x < nx; ++x) {
+      if (x * rows + y >= best) break;
+      if (b->colhash[x] != job->target || !matchAt(img1, x, y, img2, &b->pixcmp)) continue;
+      if (job->first) {
+        // Lower the shared best rank to ours, unless another band beat it
+        long rank = x * rows + y;
+        while (rank < best && !atomic_compare_exchange_weak(&job->best, &best, rank)) {
+        }
+        break;
+      }
+      if (b->count == b->capacity) {
+        int capacity = max(16, 2 * b->capacity);
+        ImagePos* pos = realloc(b->pos, (size_t)capacity * sizeof(ImagePos));
+        if (pos == NULL) {
+          b->failed = 1;
+          break;
+        }
+        b->pos = pos;
+        b->capacity = capacity;
+      }
+      b->pos[b->count].x = x;
+      b->pos[b->count].y = y;
+      b->count++;
+    }
+    // Roll the window hashes down one row
+    if (y + 1 < b->y1) {
+      hashWindows(img1->pixel + (size_t)y * img1->stride, W, w, job->topx, b->out);
+      hashWindows(img1->pixel + (size_t)(y + h) * img1->stride, W, w, job->topx, b->in);
+      for (int x = 0; x < nx; ++x) {
+        b->colhash[x] = (b->colhash[x] - b->out[x] * job->topy) * HASH_BY + b->in[x];
+      }
+      b->pixmem += 2 * (unsigned long)W;
+    }
+  }
+}
+
+// Append (x, y) to list.  Returns 0 if list cannot grow.
+static int posAppend(ImagePosList* list, int x, int y) {
+  if (list->count == list->capacity) {
+    int capacity = max(16, 2 * list->capacity);
+    ImagePos* pos = realloc(list->pos, (size_t)capacity * sizeof(ImagePos));
+    if (pos == NULL) return 0;
+    list->pos = pos;
+    list->capacity = capacity;
+  }
+  list->pos[list->count].x = x;
+  list->pos[list->count].y = y;
+  list->count++;
+  return 1;
+}
+
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and appends every matching position to
+/// list, in raster order (by y, then by x).
+/// If first is nonzero, only the match that ImageLocateSubImage would find
+/// (smallest x, then smallest y) is appended, if any.
+/// The search is split across the threads of the library.
+/// On success, returns 1 (even if nothing is found).
+/// On failure (memory allocation), returns 0, errno/errCause are set
+/// accordingly, and list is left as it was.
+int ImageLocateAll(Image img1, Image img2, ImagePosList* list, int first) {  ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(list != NULL);
+  assert(list->count >= 0 && list->count <= list->capacity);
+
+  int W = img1->width, H = img1->height;
+  int w = img2->width, h = img2->height;
+  int count0 = list->count;
+  if (w > W || h > H) return 1;
+  int rows = H - h + 1;
+
+  // An empty subimage matches everywhere
+  if (w == 0 || h == 0) {
+    int success = 1;
+    for (int y = 0; y < rows && success; ++y) {
+      for (int x = 0; x <= W - w && success; ++x) {
+        success = check(posAppend(list, x, y), "Memory allocation for ImageLocateAll failed");
+        if (first) return success;
+      }
+    }
+    if (!success) list->count = count0;
+    return success;
+  }
+
+  // Bands of at least h rows (each band hashes h rows before it starts),
+  // and not so small that waking the workers is not worth it
+  long nbands = (long)rows * W / POOL_MIN_BAND_BYTES;
+  if (nbands > 4L * ImageThreads()) nbands = 4L * ImageThreads();
+  if (nbands > rows / h) nbands = rows / h;
+  if (nbands < 1) nbands = 1;
+
+  struct locateJob job = {img1, img2, 0, hashPow(HASH_BX, w - 1), hashPow(HASH_BY, h - 1), first, LONG_MAX, NULL};
+  for (int y0 = 0; y0 < h; ++y0) {
+    job.target = job.target * HASH_BY + hashRow(img2->pixel + (size_t)y0 * img2->stride, w);
+  }
+  job.bands = calloc(nbands, sizeof(struct locateBand));
+  int success = check(job.bands != NULL, "Memory allocation for ImageLocateAll failed");
+  for (int i = 0; success && i < nbands; ++i) {
+    struct locateBand* b = &job.bands[i];
+    b->job = &job;
+    b->y0 = (int)((long)rows * i / nbands);
+    b->y1 = (int)((long)rows * (i + 1) / nbands);
+    b->colhash = malloc(3 * (size_t)(W - w + 1) * sizeof(uint64_t));
+    b->out = b->colhash + (W - w + 1);
+    b->in = b->out + (W - w + 1);
+    success = check(b->colhash != NULL, "Memory allocation for ImageLocateAll failed");
+  }
+
+  if (success) {
+    poolRun(nbands, locateBandRun, &job);
+    PIXMEM += (unsigned long)w * h;  // hash of img2
+    for (int i = 0; i < nbands; ++i) {
+      struct locateBand* b = &job.bands[i];
+      PIXMEM += b->pixmem + 2 * b->pixcmp;
+      PIXCMP += b->pixcmp;
+      success = success && check(!b->failed, "Memory allocation for ImageLocateAll failed");
+      for (int k = 0; success && k < b->count; ++k) {
+        success = check(posAppend(list, b->pos[k].x, b->pos[k].y), "Memory allocation for ImageLocateAll failed");
+      }
+    }
+    long best = atomic_load(&job.best);
+    if (success && first && best != LONG_MAX) {
+      success = check(posAppend(list, (int)(best / rows), (int)(best % rows)),
+                      "Memory allocation for ImageLocateAll failed");
+    }
+  }
+
+  // Cleanup
+  errsave = errno;
+  for (int i = 0; job.bands != NULL && i < nbands; ++i) {
+    free(job.bands[i].colhash);
+    free(job.bands[i].pos);
+  }
+  free(job.bands);
+  if (!success) list->count = count0;
+  errno = errsave;
+  return success;
+}
+
+// Multi-template search (Baker-Bird)
+//
+// ImageLocateMany finds any number of subimages in a single pass over the
+// image, in two stages, each an Aho-Corasick automaton (a trie of patterns
+// with failure links, which finds all occurrences of all patterns in one
+// left-to-right pass over a text):
+//  1. The distinct rows of all subimages are the patterns of an automaton
+//     run along each row of the image.  At every position it reports which
+//     subimage rows end there (at most one per row width).
+//  2. Each subimage is then the sequence of the ids of its rows, and these
+//     sequences are the patterns of a second automaton, run down every
+//     column of row ids reported by the first one:  one state per column
+//     and per distinct subimage width.
+// So the cost is one pass over the image, plus work proportional to the
+// number of distinct widths and to the number of matches, whatever the
+// number of subimages.
+
+// A node of an automaton:  the string of symbols from the root to it
+struct acNode {
+  int parent, sym;      // edge from the parent
+  int child, sibling;   // list of children
+  int fail;             // node of the longest proper suffix in the trie
+  int dict;             // nearest node along the fail chain with out >= 0
+  int out;              // pattern ending at this node, or -1
+};
+
+// Aho-Corasick automaton over int symbols, with a fixed node capacity.
+// Edges are found through a hash table of child nodes, keyed by (parent, sym).
+struct acAuto {
+  struct acNode* node;
+  int nnodes;
+  int* edge;            // open addressing, -1 for empty slots
+  size_t mask;          // edge table size - 1
+  int* queue;           // for the breadth-first construction
+};
+
+// Prepare a to hold up to capacity nodes (including the root).
+// On failure, returns 0 and errCause is set.
+static int acInit(struct acAuto* a, int capacity) {
+  size_t size = 2;
+  while (size < 2 * (size_t)capacity) {
+    size <<= 1;
+  }
+  a->node = malloc((size_t)capacity * sizeof(struct acNode));
+  a->edge = malloc(size * sizeof(int));
+  a->queue = malloc((size_t)capacity * sizeof(int));
+  a->mask = size - 1;
+  a->nnodes = 1;
+  if (!check(a->node != NULL && a->edge != NULL && a->queue != NULL, "Memory allocation for automaton failed")) {
+    return 0;
+  }
+  memset(a->edge, 0xff, size * sizeof(int));
+  a->node[0] = (struct acNode){-1, -1, -1, -1, 0, -1, -1};
+  return 1;
+}
+
+static void acFree(struct acAuto* a) {
+  free(a->node);
+  free(a->edge);
+  free(a->queue);
+}
+
+static size_t acSlot(const struct acAuto* a, int s, int c) {
+  return ((uint32_t)s * 0x9E3779B1u ^ (uint32_t)c * 0x85EBCA77u) & a->mask;
+}
+
+// Child of node s by symbol c, or -1.
+static int acChild(const struct acAuto* a, int s, int c) {
+  for (size_t k = acSlot(a, s, c);; k = (k + 1) & a->mask) {
+    int u = a->edge[k];
+    if (u < 0 || (a->node[u].parent == s && a->node[u].sym == c)) return u;
+  }
+}
+
+// Child of node s by symbol c, created if needed (within capacity).
+static int acAdd(struct acAuto* a, int s, int c) {
+  size_t k = acSlot(a, s, c);
+  for (; a->edge[k] >= 0; k = (k + 1) & a->mask) {
+    int u = a->edge[k];
+    if (a->node[u].parent == s && a->node[u].sym == c) return u;
+  }
+  int u = a->nnodes++;
+  a->node[u] = (struct acNode){s, c, -1, a->node[s].child, 0, -1, -1};
+  a->node[s].child = u;
+  a->edge[k] = u;
+  return u;
+}
+
+// Next state after reading symbol c in state s.
+static int acStep(const struct acAuto* a, int s, int c) {
+  int t;
+  while ((t = acChild(a, s, c)) < 0 && s != 0) {
+    s = a->node[s].fail;
+  }
+  return t < 0 ? 0 : t;
+}
+
+// Compute the fail and dict links, breadth first.
+static void acBuild(struct acAuto* a) {
+  int head = 0, tail = 0;
+  a->queue[tail++] = 0;
+  while (head < tail) {
+    int s = a->queue[head++];
+    for (int u = a->node[s].child; u >= 0; u = a->node[u].sibling) {
+      struct acNode* n = &a->node[u];
+      n->fail = s == 0 ? 0 : acStep(a, a->node[s].fail, n->sym);
+      const struct acNode* f = &a->node[n->fail];
+      n->dict = f->out >= 0 ? n->fail : f->dict;
+      a->queue[tail++] = u;
+    }
+  }
+}
+
+// First node with an output at state s (then follow dict links), or -1.
+static int acOutput(const struct acAuto* a, int s) {
+  return a->node[s].out >= 0 ? s : a->node[s].dict;
+}
+
+/// Locate all occurrences of several subimages inside another image.
+/// Searches for each of the n images subs[i] inside img1, and appends every
+/// matching position of subs[i] to found[i], in raster order (by y, then
+/// by x), as ImageLocateAll would.  The image is scanned only once.
+/// On success, returns 1 (even if nothing is found).
+/// On failure (memory allocation), returns 0, errno/errCause are set
+/// accordingly, and the found lists are left as they were.
+int ImageLocateMany(Image img1, int n, Image subs[], ImagePosList found[]) {  ///
+  assert(img1 != NULL);
+  assert(n >= 0);
+  int W = img1->width, H = img1->height;
+
+  // Sizes of the automata, and the distinct widths
+  int nrows = 0, nbytes = 0, ngroups = 0;
+  int* count0 = malloc((size_t)(n + 1) * sizeof(int));
+  int* groupw = malloc((size_t)(n + 1) * sizeof(int));
+  int success = check(count0 != NULL && groupw != NULL, "Memory allocation for ImageLocateMany failed");
+  for (int i = 0; count0 != NULL && i < n; ++i) {
+    assert(subs[i] != NULL);
+    assert(found[i].count >= 0 && found[i].count <= found[i].capacity);
+    count0[i] = found[i].count;
+  }
+  for (int i = 0; success && i < n; ++i) {
+    int w = subs[i]->width, h = subs[i]->height;
+    if (w == 0 || h == 0 || w > W || h > H) continue;
+    nrows += h;
+    nbytes += w * h;
+    int g = 0;
+    while (g < ngroups && groupw[g] != w) {
+      g++;
+    }
+    if (g == ngroups) groupw[ngroups++] = w;
+  }
+
+  struct acAuto rows = {NULL}, cols = {NULL};
+  int* rowlen = NULL;        // width of each distinct row
+  int* rowgroup = NULL;      // width group of each distinct row
+  int* nextsame = NULL;      // next subimage with the same rows, or -1
+  int* label = NULL;         // per group and x: id of the row starting there
+  int* state = NULL;         // per group and x: column automaton state
+  size_t cells = (size_t)max(ngroups, 1) * (W + 1);
+  success = success && acInit(&rows, nbytes + 1) && acInit(&cols, nrows + 1) &&
+            check((rowlen = malloc((size_t)(nrows + 1) * sizeof(int))) != NULL &&
+                      (rowgroup = malloc((size_t)(nrows + 1) * sizeof(int))) != NULL &&
+                      (nextsame = malloc((size_t)(n + 1) * sizeof(int))) != NULL &&
+                      (label = malloc(cells * sizeof(int))) != NULL &&
+                      (state = calloc(cells, sizeof(int))) != NULL,
+                  "Memory allocation for ImageLocateMany failed");
+
+  if (success) {
+    // Stage 1 patterns: distinct rows.  Stage 2 patterns: row id sequences.
+    int nids = 0;
+    for (int i = 0; i < n; ++i) {
+      nextsame[i] = -1;
+      int w = subs[i]->width, h = subs[i]->height;
+      if (w == 0 || h == 0 || w > W || h > H) continue;
+      int g = 0;
+      while (groupw[g] != w) {
+        g++;
+      }
+      int c = 0;
+      for (int y0 = 0; y0 < h; ++y0) {
+        const uint8* row = subs[i]->pixel + (size_t)y0 * subs[i]->stride;
+        int s = 0;
+        for (int x0 = 0; x0 < w; ++x0) {
+          s = acAdd(&rows, s, row[x0]);
+        }
+        if (rows.node[s].out < 0) {
+          rowlen[nids] = w;
+          rowgroup[nids] = g;
+          rows.node[s].out = nids++;
+        }
+        c = acAdd(&cols, c, rows.node[s].out);
+      }
+      // Identical subimages share the end node
+      nextsame[i] = cols.node[c].out;
+      cols.node[c].out = i;
+      PIXMEM += (unsigned long)w * h;
+    }
+    acBuild(&rows);
+    acBuild(&cols);
+
+    for (int y = 0; y < H && success; ++y) {
+      const uint8* row = img1->pixel + (size_t)y * img1->stride;
+      for (size_t k = 0; k < cells; ++k) {
+        label[k] = -1;
+      }
+      // Stage 1: label the start of each subimage row ending at each x
+      int s = 0;
+      for (int x = 0; x < W; ++x) {
+        s = acStep(&rows, s, row[x]);
+        for (int u = acOutput(&rows, s); u >= 0; u = rows.node[u].dict) {
+          int id = rows.node[u].out;
+          label[(size_t)rowgroup[id] * (W + 1) + x - rowlen[id] + 1] = id;
+        }
+      }
+      PIXMEM += (unsigned long)W;
+      // Stage 2: advance each column, report subimages ending at row y
+      for (int g = 0; g < ngroups && success; ++g) {
+        int* lab = label + (size_t)g * (W + 1);
+        int* st = state + (size_t)g * (W + 1);
+        for (int x = 0; x <= W - groupw[g] && success; ++x) {
+          st[x] = lab[x] < 0 ? 0 : acStep(&cols, st[x], lab[x]);
+          for (int u = acOutput(&cols, st[x]); u >= 0 && success; u = cols.node[u].dict) {
+            for (int i = cols.node[u].out; i >= 0 && success; i = nextsame[i]) {
+              success = check(posAppend(&found[i], x, y - subs[i]->height + 1),
+                              "Memory allocation for ImageLocateMany failed");
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Empty subimages match everywhere
+  for (int i = 0; success && i < n; ++i) {
+    if (subs[i]->width == 0 || subs[i]->height == 0) {
+      success = ImageLocateAll(img1, subs[i], &found[i], 0);
+    }
+  }
+
+  // Cleanup
+  errsave = errno;
+  for (int i = 0; !success && count0 != NULL && i < n; ++i) {
+    found[i].count = count0[i];
+  }
+  acFree(&rows);
+  acFree(&cols);
+  free(count0);
+  free(groupw);
+  free(rowlen);
+  free(rowgroup);
+  free(nextsame);
+  free(label);
+  free(state);
+  errno = errsave;
+  return success;
+}
+
+// Image pyramids
+//
+// Level k of a pyramid is the image reduced 2^k times in each direction:
+// each of its pixels is the (rounded) mean of a 2x2 block of level k-1, so
+// it is a function of the pixels of a 2^k x 2^k block of the image, aligned
+// to multiples of 2^k (odd last rows and columns are dropped).
+//
+// If a subimage matches at (x, y), the blocks of the image inside the
+// window are equal to the corresponding blocks of the subimage, and so are
+// their reductions.  Which blocks of the subimage these are depends on the
+// phase (x mod 2^k, y mod 2^k), so the subimage is reduced once for each of
+// the 4^k phases, and each reduced subimage is compared at the level-k
+// positions of that phase only.  Positions are enumerated from an index of
+// level k by pixel level (built on first use and kept with the pyramid), so
+// only those whose first block already agrees are looked at.  Survivors are
+// compared in full, and the first in ImageLocateSubImage's order wins:
+// the result is always the same as the plain scan's.
+
+#define PYRAMID_MAXLEVELS 16
+
+struct imagePyramid {
+  int nlevels;
+  Image level[PYRAMID_MAXLEVELS];    // level[0] is the image itself (not owned)
+  uint32_t* index[PYRAMID_MAXLEVELS];  // positions of each level, by pixel level
+  uint32_t* start[PYRAMID_MAXLEVELS];  // index[k] + start[k][v]: positions with level v
+};
+
+// Reduce the w x h raster src into dst, of (w/2) x (h/2) 2x2 block means.
+static void reduceRaster(const uint8* src, size_t sstride, int w, int h, uint8* dst, size_t dstride) {
+  for (int y = 0; y < h / 2; ++y) {
+    const uint8* r0 = src + (size_t)(2 * y) * sstride;
+    const uint8* r1 = r0 + sstride;
+    uint8* out = dst + (size_t)y * dstride;
+    for (int x = 0; x < w / 2; ++x) {
+      out[x] = (uint8)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) / 4);
+    }
+  }
+}
+
+/// Create the pyramid of img, with up to nlevels levels (nlevels >= 1).
+/// Level 0 is img itself and each further level is half the size of the
+/// previous one (rounding down), stopping before levels become empty.
+/// img must not be changed or destroyed while the pyramid is in use.
+///
+/// On success, a new pyramid is returned.
+/// (The caller is responsible for destroying the returned pyramid!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePyramid ImagePyramidCreate(Image img, int nlevels) {  ///
+  assert(img != NULL);
+  assert(nlevels >= 1);
+
+  ImagePyramid p = calloc(1, sizeof(struct imagePyramid));
+  if (!check(p != NULL, "Memory allocation for ImagePyramid failed")) {
+    return NULL;
+  }
+  p->level[0] = img;
+  p->nlevels = 1;
+  nlevels = min(nlevels, PYRAMID_MAXLEVELS);
+  while (p->nlevels < nlevels) {
+    Image prev = p->level[p->nlevels - 1];
+    if (prev->width < 2 || prev->height < 2) break;
+    Image next = newImage(prev->width / 2, prev->height / 2, prev->maxval);
+    if (next == NULL) {
+      ImagePyramidDestroy(&p);
+      return NULL;
+    }
+    reduceRaster(prev->pixel, prev->stride, prev->width, prev->height, next->pixel, next->stride);
+    PIXMEM += (unsigned long)prev->width * prev->height + (unsigned long)next->width * next->height;
+    p->level[p->nlevels++] = next;
+  }
+  return p;
+}
+
+/// Destroy the pyramid pointed to by (*pp) (but not its base image).
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void ImagePyramidDestroy(ImagePyramid* pp) {  ///
+  assert(pp != NULL);
+  ImagePyramid p = *pp;
+  if (p == NULL) return;
+  for (int k = 0; k < p->nlevels; ++k) {
+    if (k > 0) ImageDestroy(&p->level[k]);
+    free(p->index[k]);
+    free(p->start[k]);
+  }
+  free(p);
+  *pp = NULL;
+}
+
+/// Number of levels of pyramid p.
+int ImagePyramidLevels(ImagePyramid p) {  ///
+  assert(p != NULL);
+  return p->nlevels;
+}
+
+/// Level k of pyramid p (level 0 is the base image).
+/// The image belongs to the pyramid:  do not modify or destroy it.
+Image ImagePyramidLevel(ImagePyramid p, int k) {  ///
+  assert(p != NULL);
+  assert(0 <= k && k < p->nlevels);
+  return p->level[k];
+}
+
+// Build the index of level k of p (a counting sort of its positions by
+// pixel level), if not done yet.  Returns 0 if memory is short.
+static int pyramidIndex(ImagePyramid p, int k) {
+  if (p->index[k] != NULL) return 1;
+  Image img = p->level[k];
+  uint32_t* start = calloc(257, sizeof(uint32_t));
+  uint32_t* index = malloc((size_t)img->width * img->height * sizeof(uint32_t) + 1);
+  if (start == NULL || index == NULL) {
+    free(start);
+    free(index);
+    return 0;
+  }
   for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->height; ++x) {
-      uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(new_img, new_img->width - x - 1, y, pixel);
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    for (int x = 0; x < img->width; ++x) {
+      start[row[x] + 1]++;
+    }
+  }
+  for (int v = 0; v < 256; ++v) {
+    start[v + 1] += start[v];
+  }
+  uint32_t next[256];
+  memcpy(next, start, sizeof(next));
+  for (int y = 0; y < img->height; ++y) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    for (int x = 0; x < img->width; ++x) {
+      index[next[row[x]]++] = (uint32_t)y * img->width + x;
+    }
+  }
+  PIXMEM += 2 * (unsigned long)img->width * img->height;
+  p->start[k] = start;
+  p->index[k] = index;
+  return 1;
+}
+
+/// Locate a subimage inside the base image of a pyramid.
+/// The result is exactly that of ImageLocateSubImage(base image, ...), but
+/// candidate positions are first filtered at a coarse level of p.
+/// Building the pyramid (and the index each level gets on first use) is
+/// paid once, and then amortized over all subimages searched in it.
+int ImageLocatePyramid(ImagePyramid p, int* px, int* py, Image img2) {  ///
+  assert(p != NULL);
+  assert(img2 != NULL);
+  Image img1 = p->level[0];
+  int W = img1->width, H = img1->height;
+  int w = img2->width, h = img2->height;
+  if (w > W || h > H) return 0;
+
+  // The coarsest level where every phase of img2 still has a whole block
+  // (2s-1 <= w, h), and whose 4^k reduced subimages cost no more than one
+  // pass over the image
+  int k = 0;
+  while (k + 1 < p->nlevels && 2 * (2 << k) - 1 <= min(w, h) &&
+         (double)(2 << k) * (2 << k) * w * h <= (double)W * H) {
+    k++;
+  }
+  int s = 1 << k;
+  uint8* buf = k > 0 ? malloc(2 * (size_t)w * h + 1) : NULL;
+  if (buf == NULL || !pyramidIndex(p, k)) {
+    free(buf);
+    return ImageLocateSubImage(img1, px, py, img2);
+  }
+  Image coarse = p->level[k];
+  uint8* halves[2] = {buf, buf + (size_t)w * h};
+
+  int found = 0, bx = 0, by = 0;
+  unsigned long ncmp = 0;
+  for (int dy = 0; dy < s; ++dy) {
+    for (int dx = 0; dx < s; ++dx) {
+      // Reduce img2 from (dx, dy) k times
+      const uint8* src = img2->pixel + (size_t)dy * img2->stride + dx;
+      size_t sstride = img2->stride;
+      int cw = w - dx, ch = h - dy;
+      for (int j = 0; j < k; ++j) {
+        uint8* dst = halves[j & 1];
+        reduceRaster(src, sstride, cw, ch, dst, (size_t)cw / 2);
+        src = dst;
+        sstride = (size_t)cw / 2;
+        cw /= 2;
+        ch /= 2;
+      }
+      PIXMEM += (unsigned long)(w - dx) * (h - dy);
+
+      // Positions (X0, Y0) of level k where the first block agrees
+      const uint32_t* pos = p->index[k] + p->start[k][src[0]];
+      const uint32_t* end = p->index[k] + p->start[k][src[0] + 1];
+      for (; pos < end; ++pos) {
+        int X0 = (int)(*pos % coarse->width), Y0 = (int)(*pos / coarse->width);
+        int x = X0 * s - dx, y = Y0 * s - dy;
+        if (x < 0 || y < 0 || x > W - w || y > H - h) continue;
+        if (found && (x > bx || (x == bx && y >= by))) continue;
+        int agree = 1;
+        for (int j = 0; j < ch && agree; ++j) {
+          agree = memcmp(coarse->pixel + (size_t)(Y0 + j) * coarse->stride + X0, src + (size_t)j * sstride, cw) == 0;
+          ncmp += (unsigned long)cw;
+        }
+        if (agree && matchAt(img1, x, y, img2, &ncmp)) {
+          found = 1;
+          bx = x;
+          by = y;
+        }
+      }
     }
   }
+  PIXCMP += ncmp;
+  PIXMEM += 2 * ncmp;
+  free(buf);
 
-  return new_img;
+  if (found) {
+    *px = bx;
+    *py = by;
+  }
+  return found;
 }
 
-/// Crop a rectangular subimage from img.
-/// The rectangle is specified by the top left corner coords (x, y) and
-/// width w and height h.
-/// Requires:
-///   The rectangle must be inside the original image.
-/// Ensures:
-///   The original img is not modified.
-///   The returned image has width w and height h.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCrop(Image img, int x, int y, int w, int h) {  ///
-  assert(img != NULL);
-  assert(ImageValidRect(img, x, y, w, h));
+// Best (least squares) match
+//
+// The sum of squared differences between img2 and the window of img1 at
+// (x, y) expands into three terms:
+//   SSD(x,y) = sum img1^2 (over the window) - 2 * C(x,y) + sum img2^2
+// where C(x,y) = sum img1(x+i, y+j) * img2(i, j) is the cross-correlation.
+// The first term comes from a summed-area table of img1^2, in O(1) per
+// position, and the last one is a constant.  The cross-correlation of all
+// positions at once is the inverse Fourier transform of FFT(img1) times the
+// conjugate of FFT(img2), so all SSDs cost O(W*H*log(W*H)) instead of
+// O(W*H*w*h).
+//
+// To bound the memory, img1 is not transformed whole but in tiles of at most
+// about LOCATE_MAX_POINTS pixels (overlap-save):  the circular
+// cross-correlation of a P x Q tile with img2 is exact at the positions
+// where img2 does not wrap around, (P-w+1) x (Q-h+1) of them, and tiles
+// overlap by w-1 columns and h-1 rows so that every position is covered.
+// The transform of img2 is computed once; the tiles are real, so two of
+// them go through each complex FFT (one as the real part, the other as the
+// imaginary part), and the correlations come out as the real and imaginary
+// parts of the inverse transform.
+// Products are exact integers, and the FFT error is far below 1/2 for any
+// tile that fits in memory, so rounding C gives every SSD exactly.
+//
+// For small subimages, the direct computation (vectorized, and abandoning
+// a position as soon as it is worse than the best so far) is faster.
 
-  Image new_img = ImageCreate(w, h, img->maxval);
+struct cplx {
+  double re, im;
+};
 
-  // ImageCreate() already sets errno/errCause
-  if (new_img == NULL) {
-    return NULL;
+#define PI 3.14159265358979323846
+
+// Compute sin(a) and cos(a) for 0 <= a <= pi, from their Taylor series.
+// (We do not link with libm, see min/max/round above.)
+static void sinCos(double a, double* s, double* c) {
+  double sterm = a, cterm = 1.0;
+  *s = 0.0;
+  *c = 0.0;
+  for (int k = 1; k < 40; k += 2) {
+    *s += sterm;
+    *c += cterm;
+    sterm *= -a * a / ((k + 1) * (k + 2));
+    cterm *= -a * a / (k * (k + 1));
+  }
+}
+
+// Allocate the twiddle factors of an n-point FFT: exp(-2*pi*i*k/n), k < n/2.
+// Returns NULL if allocation fails.
+static struct cplx* newTwiddles(int n) {
+  struct cplx* tw = malloc((size_t)(n / 2 + 1) * sizeof(struct cplx));
+  if (tw == NULL) return NULL;
+  for (int k = 0; k < n / 2; ++k) {
+    double s, c;
+    sinCos(2 * PI * k / n, &s, &c);
+    tw[k].re = c;
+    tw[k].im = -s;
   }
+  return tw;
+}
 
-  for (int i = x; i < x + w; ++i) {
-    for (int j = y; j < y + h; ++j) {
-      uint8 pixel = ImageGetPixel(img, i, j);
-      ImageSetPixel(new_img, i - x, j - x, pixel);
+// In-place radix-2 FFT of count interleaved vectors of n points (n a power
+// of 2):  point j of vector v is a[j*stride + v].  So count == 1 and
+// stride == 1 transforms one row, and count == stride == row length
+// transforms all columns at once, streaming along whole rows.
+// The inverse transform is not scaled by 1/n.
+static void fft(struct cplx* a, int n, size_t stride, int count, const struct cplx* tw, int inverse) {
+  // Bit-reversal permutation
+  for (int i = 1, j = 0; i < n; ++i) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      struct cplx* u = a + i * stride;
+      struct cplx* v = a + j * stride;
+      for (int c = 0; c < count; ++c) {
+        struct cplx t = u[c];
+        u[c] = v[c];
+        v[c] = t;
+      }
+    }
+  }
+  // Butterflies
+  for (int len = 2; len <= n; len <<= 1) {
+    int step = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < len / 2; ++k) {
+        double wr = tw[k * step].re;
+        double wi = inverse ? -tw[k * step].im : tw[k * step].im;
+        struct cplx* u = a + (i + k) * stride;
+        struct cplx* v = a + (i + k + len / 2) * stride;
+        for (int c = 0; c < count; ++c) {
+          double tr = v[c].re * wr - v[c].im * wi;
+          double ti = v[c].re * wi + v[c].im * wr;
+          v[c].re = u[c].re - tr;
+          v[c].im = u[c].im - ti;
+          u[c].re += tr;
+          u[c].im += ti;
+        }
+      }
     }
   }
+}
 
-  assert(new_img->width == w && new_img->height == h);
+// A 2D FFT of a P x Q array (both powers of 2), split in pool tasks.
+struct fftJob {
+  struct cplx* a;
+  int P, Q;
+  const struct cplx *twP, *twQ;
+  int inverse;
+};
 
-  return new_img;
+// Transform rows [y0, y1).
+static void fftRows(void* arg, int y0, int y1) {
+  struct fftJob* job = arg;
+  for (int y = y0; y < y1; ++y) {
+    fft(job->a + (size_t)y * job->P, job->P, 1, 1, job->twP, job->inverse);
+  }
 }
 
-/// Operations on two images
+// Transform columns [x0, x1).
+static void fftColumns(void* arg, int x0, int x1) {
+  struct fftJob* job = arg;
+  fft(job->a + x0, job->Q, (size_t)job->P, x1 - x0, job->twQ, job->inverse);
+}
 
-/// Paste an image into a larger image.
-/// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) {  ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+static void fft2(struct fftJob* job) {
+  size_t bytes = sizeof(struct cplx);
+  poolRows(job->Q, (size_t)job->P * bytes, fftRows, job);
+  poolRows(job->P, (size_t)job->Q * bytes, fftColumns, job);
+}
 
-  for (int y0 = 0; y0 < img2->height; ++y0) {
-    for (int x0 = 0; x0 < img2->width; ++x0) {
-      uint8 pixel = ImageGetPixel(img2, x0, y0);
-      ImageSetPixel(img1, x + x0, y + y0, pixel);
+// Sum of squared differences of the n levels of a and b.
+static uint64_t ssdRow(const uint8* a, const uint8* b, int n) {
+  uint64_t sum = 0;
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    // 32-bit lanes gain at most 2*2*255^2 per 16 pixels: flush them often
+    __m128i acc = _mm_setzero_si128();
+    for (int k = 0; k < 4096 && i + 16 <= n; ++k, i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      __m128i dlo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+      __m128i dhi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(dlo, dlo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(dhi, dhi));
     }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
   }
+#endif
+  for (; i < n; ++i) {
+    int d = a[i] - b[i];
+    sum += (uint64_t)(d * d);
+  }
+  return sum;
 }
 
-/// Blend an image into a larger image.
-/// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-/// alpha usually is in [0.0, 1.0], but values outside that interval
-/// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {  ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+// SSD of img2 and the window of img1 at (x, y), or some value > limit if
+// that is exceeded.
+static uint64_t ssdAt(Image img1, int x, int y, Image img2, uint64_t limit) {
+  uint64_t sum = 0;
+  for (int y0 = 0; y0 < img2->height && sum <= limit; ++y0) {
+    sum += ssdRow(img1->pixel + (size_t)(y + y0) * img1->stride + x, img2->pixel + (size_t)y0 * img2->stride,
+                  img2->width);
+    PIXMEM += 2 * (unsigned long)img2->width;
+    PIXCMP += (unsigned long)img2->width;
+  }
+  return sum;
+}
 
-  for (int y0 = 0; y0 < img2->height; ++y0) {
-    for (int x0 = 0; x0 < img2->width; ++x0) {
-      uint8 pixel1 = ImageGetPixel(img1, x + x0, y + y0);
-      uint8 pixel2 = ImageGetPixel(img2, x0, y0);
+// Find the least-SSD position directly.
+static void locateBestDirect(Image img1, Image img2, int* px, int* py, uint64_t* pscore) {
+  uint64_t best = UINT64_MAX;
+  for (int x = 0; x <= img1->width - img2->width; ++x) {
+    for (int y = 0; y <= img1->height - img2->height; ++y) {
+      uint64_t ssd = ssdAt(img1, x, y, img2, best);
+      if (ssd < best) {
+        best = ssd;
+        *px = x;
+        *py = y;
+      }
+    }
+  }
+  *pscore = best;
+}
 
-      int blended_pixel = round(pixel1 * (1 - alpha) + pixel2 * alpha);
+// Smallest power of 2 >= n.
+static int pow2AtLeast(int n) {
+  int p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
 
-      if (blended_pixel > img1->maxval) {
-        blended_pixel = img1->maxval;
-      } else if (blended_pixel < 0) {
-        blended_pixel = 0;
-      }
+// Preferred tile side, and most points of a tile (unless img2 needs more):
+// the buffers of the search then take at most 40 bytes per point (64 MiB).
+#define LOCATE_TILE 1024
+#define LOCATE_MAX_POINTS ((size_t)1 << 21)
+
+// Tiled FFT search of ImageLocateBest (see above)
+struct locateFFT {
+  Image img1, img2;
+  int P, Q;                       // tile size (powers of 2)
+  struct cplx* z;                 // P x Q work array
+  struct cplx* f2;                // FFT of img2, zero-padded to P x Q
+  const struct cplx *twP, *twQ;   // twiddle factors
+  uint64_t* sq;                   // summed-area table of img1^2 over a tile
+  uint64_t energy2;               // sum of img2^2
+  uint64_t best;                  // least SSD so far, at (bx, by)
+  int bx, by;
+};
 
-      ImageSetPixel(img1, x + x0, y + y0, blended_pixel);
+// Choose the tile size P x Q of search L (img2 is w x h):  as large as
+// LOCATE_TILE (or twice img2, so that at least half of each tile is
+// useful), but no larger than img1 needs nor than LOCATE_MAX_POINTS allows,
+// while still larger than img2.
+static void locateTileSize(struct locateFFT* L) {
+  int W = L->img1->width, H = L->img1->height;
+  int w = L->img2->width, h = L->img2->height;
+  L->P = min(pow2AtLeast(W), max(pow2AtLeast(2 * w), LOCATE_TILE));
+  L->Q = min(pow2AtLeast(H), max(pow2AtLeast(2 * h), LOCATE_TILE));
+  while ((size_t)L->P * L->Q > LOCATE_MAX_POINTS) {
+    if (L->P >= L->Q && L->P / 2 > w) {
+      L->P /= 2;
+    } else if (L->Q / 2 > h) {
+      L->Q /= 2;
+    } else if (L->P / 2 > w) {
+      L->P /= 2;
+    } else {
+      break;
     }
   }
 }
 
-/// Compare an image to a subimage of a larger image.
-/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) {  ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidPos(img1, x, y));
-  int match = 1;
+// Find the least SSD among the positions of the tile of img1 at (tx, ty),
+// whose correlations with img2 are the part (0: real, 1: imaginary) of
+// L->z, scaled by P*Q.
+static void locateScanTile(struct locateFFT* L, int tx, int ty, int part) {
+  Image img1 = L->img1;
+  int w = L->img2->width, h = L->img2->height;
+  int tw = min(L->P, img1->width - tx), th = min(L->Q, img1->height - ty);
+  size_t sw = (size_t)tw + 1;
+  uint64_t* sq = L->sq;
+  for (size_t k = 0; k < sw; ++k) {
+    sq[k] = 0;
+  }
+  for (int y = 0; y < th; ++y) {
+    const uint8* row = img1->pixel + (size_t)(ty + y) * img1->stride + tx;
+    uint64_t* sqrow = sq + (size_t)(y + 1) * sw;
+    uint64_t rowsum = 0;
+    sqrow[0] = 0;
+    for (int x = 0; x < tw; ++x) {
+      rowsum += (uint64_t)row[x] * row[x];
+      sqrow[x + 1] = sqrow[x + 1 - sw] + rowsum;
+    }
+  }
 
-  for (int y0 = 0; y0 < img2->height && match; ++y0) {
-    for (int x0 = 0; x0 < img2->width && match; ++x0) {
-      uint8 pixel1 = ImageGetPixel(img1, x + x0, y + y0);
-      uint8 pixel2 = ImageGetPixel(img2, x0, y0);
-      PIXCMP += 1;
-      match = pixel1 == pixel2;
+  double scale = 1.0 / ((double)L->P * L->Q);
+  for (int x = 0; x <= tw - w; ++x) {
+    for (int y = 0; y <= th - h; ++y) {
+      uint64_t energy1 = sq[(size_t)(y + h) * sw + x + w] - sq[(size_t)y * sw + x + w] -
+                         sq[(size_t)(y + h) * sw + x] + sq[(size_t)y * sw + x];
+      const struct cplx* c = &L->z[(size_t)y * L->P + x];
+      int64_t cross = (int64_t)((part == 0 ? c->re : c->im) * scale + 0.5);
+      uint64_t ssd = energy1 + L->energy2 - 2 * (uint64_t)cross;
+      // Ties go to the smallest x, then the smallest y
+      int X = tx + x, Y = ty + y;
+      if (ssd < L->best || (ssd == L->best && (X < L->bx || (X == L->bx && Y < L->by)))) {
+        L->best = ssd;
+        L->bx = X;
+        L->by = Y;
+      }
     }
   }
+}
 
-  return match;
+// Search the n (1 or 2) tiles of img1 at (tx[k], ty[k]) with one FFT.
+static void locateTiles(struct locateFFT* L, const int tx[], const int ty[], int n) {
+  Image img1 = L->img1;
+  int P = L->P, Q = L->Q;
+  for (int y = 0; y < Q; ++y) {
+    struct cplx* zrow = L->z + (size_t)y * P;
+    for (int x = 0; x < P; ++x) {
+      zrow[x].re = 0;
+      zrow[x].im = 0;
+    }
+    for (int k = 0; k < n; ++k) {
+      if (ty[k] + y >= img1->height) continue;
+      const uint8* row = img1->pixel + (size_t)(ty[k] + y) * img1->stride + tx[k];
+      int tw = min(P, img1->width - tx[k]);
+      for (int x = 0; x < tw; ++x) {
+        if (k == 0) {
+          zrow[x].re = row[x];
+        } else {
+          zrow[x].im = row[x];
+        }
+      }
+      PIXMEM += (unsigned long)tw;
+    }
+  }
+
+  // Z times the conjugate of FFT(img2), back:  both correlations at once
+  struct fftJob job = {L->z, P, Q, L->twP, L->twQ, 0};
+  fft2(&job);
+  for (size_t i = 0; i < (size_t)P * Q; ++i) {
+    struct cplx a = L->z[i], b = L->f2[i];
+    L->z[i].re = a.re * b.re + a.im * b.im;
+    L->z[i].im = a.im * b.re - a.re * b.im;
+  }
+  job.inverse = 1;
+  fft2(&job);
+
+  for (int k = 0; k < n; ++k) {
+    locateScanTile(L, tx[k], ty[k], k);
+  }
 }
 
-/// Locate a subimage inside another image.
-/// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
-/// If no match is found, returns 0 and (*px, *py) are left untouched.
-int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {  ///
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches img1 for the position where img2 has the least sum of squared
+/// differences (SSD) to the pixels it covers.
+/// Ties are resolved as in ImageLocateSubImage (smallest x, then smallest y).
+/// Requires: img2 must not be larger than img1.
+/// On success, returns 1, the position is set in (*px, *py) and its SSD
+/// in *pscore (0 for an exact match).
+/// On failure (memory allocation), returns 0 and errno/errCause are set
+/// accordingly.
+int ImageLocateBest(Image img1, Image img2, int* px, int* py, uint64_t* pscore) {  ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  assert(img2->width <= img1->width && img2->height <= img1->height);
 
-  for (int x = 0; x <= img1->width - img2->width; ++x) {
-    for (int y = 0; y <= img1->height - img2->height; ++y) {
-      if (ImageMatchSubImage(img1, x, y, img2)) {
-        *px = x;
-        *py = y;
-        return 1;
+  int W = img1->width, H = img1->height;
+  int w = img2->width, h = img2->height;
+  if (w == 0 || h == 0) {
+    locateBestDirect(img1, img2, px, py, pscore);
+    return 1;
+  }
+
+  struct locateFFT L = {img1, img2, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, UINT64_MAX, 0, 0};
+  locateTileSize(&L);
+  int P = L.P, Q = L.Q;
+  int stepx = P - w + 1, stepy = Q - h + 1;  // positions searched per tile
+  int ntx = (W - w) / stepx + 1, nty = (H - h) / stepy + 1;
+
+  // Rough operation counts of both methods:  one P x Q FFT per tile (two
+  // tiles share a forward and an inverse one), plus that of img2
+  double positions = (double)(W - w + 1) * (H - h + 1);
+  double log2PQ = 0;
+  for (size_t n = 1; n < (size_t)P * Q; n <<= 1) {
+    log2PQ += 1;
+  }
+  double ffts = (double)ntx * nty + 1;
+  if (positions * w * h <= 16.0 * ffts * P * Q * log2PQ) {
+    locateBestDirect(img1, img2, px, py, pscore);
+    return 1;
+  }
+
+  L.z = malloc((size_t)P * Q * sizeof(struct cplx));
+  L.f2 = malloc((size_t)P * Q * sizeof(struct cplx));
+  struct cplx* twP = newTwiddles(P);
+  struct cplx* twQ = newTwiddles(Q);
+  L.twP = twP;
+  L.twQ = twQ;
+  L.sq = malloc((size_t)(P + 1) * (Q + 1) * sizeof(uint64_t));
+  int success = check(L.z != NULL && L.f2 != NULL && twP != NULL && twQ != NULL && L.sq != NULL,
+                      "Memory allocation for ImageLocateBest failed");
+
+  if (success) {
+    // f2 = FFT(img2), zero-padded to P x Q
+    for (int y = 0; y < Q; ++y) {
+      struct cplx* row = L.f2 + (size_t)y * P;
+      const uint8* row2 = y < h ? img2->pixel + (size_t)y * img2->stride : NULL;
+      for (int x = 0; x < P; ++x) {
+        row[x].re = y < h && x < w ? row2[x] : 0;
+        row[x].im = 0;
+        if (y < h && x < w) L.energy2 += (uint64_t)row2[x] * row2[x];
+      }
+    }
+    PIXMEM += (unsigned long)w * h;
+    struct fftJob job = {L.f2, P, Q, twP, twQ, 0};
+    fft2(&job);
+
+    // The tiles, two at a time
+    int tx[2], ty[2], n = 0;
+    for (int j = 0; j < nty; ++j) {
+      for (int i = 0; i < ntx; ++i) {
+        tx[n] = i * stepx;
+        ty[n] = j * stepy;
+        if (++n == 2) {
+          locateTiles(&L, tx, ty, n);
+          n = 0;
+        }
       }
     }
+    if (n > 0) locateTiles(&L, tx, ty, n);
+
+    *px = L.bx;
+    *py = L.by;
+    // Recompute the score of the winner exactly
+    *pscore = ssdAt(img1, *px, *py, img2, UINT64_MAX);
   }
-  return 0;
+
+  // Cleanup
+  errsave = errno;
+  free(L.z);
+  free(L.f2);
+  free(twP);
+  free(twQ);
+  free(L.sq);
+  errno = errsave;
+  return success;
 }
 
 /// Filtering
@@ -663,9 +3518,9 @@ static uint8 RectAvgColor(const Image img, int x, int y, int w, int h) {
 
   for (int row = y; row < y + h; ++row) {
     for (int col = x; col < x + w; ++col) {
-      PIXADD += 1;
       sum += ImageGetPixel(img, col, row);
     }
+    PIXADD += (unsigned long)w;  // one addition per pixel (counted per row)
   }
 
   return round((double)sum / (w * h));
@@ -687,7 +3542,9 @@ void ImageBlur3(Image img, int dx, int dy) {  ///
     exit(1);
   }
 
-  memcpy(img_copy->pixel, img->pixel, img->height * img->width);
+  for (int y = 0; y < img->height; ++y) {
+    memcpy(img_copy->pixel + G(img_copy, 0, y), img->pixel + G(img, 0, y), img->width);
+  }
 
   // Store and load (copy all the pixels)
   PIXMEM += 2 * img->width * img->height;
@@ -724,16 +3581,16 @@ void ImageBlur2(Image img, int dx, int dy) {
 
   for (int y = 0; y < img->height; ++y) {
     for (int x = 0; x < img->width; ++x) {
-      PIXMEM += 1;  // Pixels_sum store
-
       pixels_sum[y * img->width + x] = ImageGetPixel(img, x, y);
 
       if (x != 0) {
-        PIXADD += 1;
-        PIXMEM += 2;  // pixels_sum store and load
         pixels_sum[y * img->width + x] += pixels_sum[y * img->width + x - 1];
       }
     }
+    // Counted per row: one pixels_sum store per pixel, and one addition
+    // (with a pixels_sum store and load) per pixel but the first
+    PIXMEM += (unsigned long)img->width + 2 * (unsigned long)max(0, img->width - 1);
+    PIXADD += (unsigned long)max(0, img->width - 1);
   }
 
   int x0, y0, x1, y1, w, h;
@@ -754,118 +3611,567 @@ void ImageBlur2(Image img, int dx, int dy) {
       // Calculate the sum of each row using the pixels_sum cumulative sum array defined above
       for (int row = y0; row <= y1; ++row) {
         sum += pixels_sum[row * img->width + x1];
-        PIXMEM += 1;
-        PIXADD += 1;
 
         // If the left border doesn't touch the image edge
         if (x0 != 0) {
           sum -= pixels_sum[row * img->width + x0 - 1];
-          PIXMEM += 1;
-          PIXADD += 1;
         }
 
         uint8 blurred_pixel = round((double)sum / (w * h));
         ImageSetPixel(img, x, y, blurred_pixel);
       }
+      // One pixels_sum load and one addition per row term
+      PIXMEM += (unsigned long)h * (x0 != 0 ? 2 : 1);
+      PIXADD += (unsigned long)h * (x0 != 0 ? 2 : 1);
     }
   }
   free(pixels_sum);
 }
 
-/// A better blur algorithm
-/// This algorithm uses an cumulative sum array to re-use all the sums
-void ImageBlur(Image img, int dx, int dy) {
+// Sliding-window box filter
+//
+// The mean filter is separable:  the sum over a (2dx+1)x(2dy+1) window is
+// the sum, over 2dx+1 columns, of the column sums over 2dy+1 rows.
+// Rows are fed to the filter from top to bottom.  It keeps, for every
+// column, the running sum over the rows of the current vertical window
+// (adding each row that enters it, and subtracting each row that leaves it),
+// and then slides a horizontal window along those column sums.
+// So each output pixel costs a few additions, whatever the window size, and
+// memory is just the column sums plus a ring with the last 2dy+2 input rows
+// (needed to subtract rows as they leave the window).
+//
+// The mean is rounded exactly as round((double)sum / n) would, but computed
+// as (2*sum + n) / (2*n) in integers, using a multiplication by the
+// reciprocal (with a final correction) instead of a division per pixel.
+// (The double quotient can only be a tie when it is exact, so both agree.)
+// Sums are 64 bits wide, so they cannot overflow for any image size.
+
+struct boxFilter {
+  int width, height;  // dimensions of the image being filtered
+  int dx, dy;         // window half sizes
+  int nring;          // number of rows in the ring (2dy+2, at most height)
+  uint8* ring;        // the last nring input rows
+  uint64_t* colsum;   // column sums over input rows [lo, nin-1]
+  int lo;             // first input row included in colsum
+  int nin, nout;      // next input row and next output row
+  int end;            // output stops before this row
+};
+
+// Prepare bf to filter a width x height image.
+// On success, returns nonzero.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int boxInit(struct boxFilter* bf, int width, int height, int dx, int dy) {
+  bf->width = width;
+  bf->height = height;
+  bf->dx = dx;
+  bf->dy = dy;
+  bf->nring = max(1, min(2 * dy + 2, height));
+  bf->lo = bf->nin = bf->nout = 0;
+  bf->end = height;
+  bf->ring = malloc((size_t)bf->nring * width + 1);
+  bf->colsum = calloc((size_t)width + 1, sizeof(uint64_t));
+  if (!check(bf->ring != NULL && bf->colsum != NULL, "Memory allocation for blur buffers failed")) {
+    free(bf->ring);
+    free(bf->colsum);
+    bf->ring = NULL;
+    bf->colsum = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// Restrict the output of bf to rows [ya, yb).
+// Input must then start at row max(0, ya-dy) and end at min(height, yb+dy).
+static void boxRange(struct boxFilter* bf, int ya, int yb) {
+  bf->lo = bf->nin = max(0, ya - bf->dy);
+  bf->nout = ya;
+  bf->end = yb;
+}
+
+// Release the buffers of bf.
+static void boxFree(struct boxFilter* bf) {
+  free(bf->ring);
+  free(bf->colsum);
+}
+
+// Feed the next input row to bf.
+static void boxPush(struct boxFilter* bf, const uint8* row) {
+  uint8* slot = bf->ring + (size_t)(bf->nin % bf->nring) * bf->width;
+  memcpy(slot, row, bf->width);
+  for (int x = 0; x < bf->width; ++x) {
+    bf->colsum[x] += slot[x];
+  }
+  bf->nin++;
+  PIXMEM += 2 * (unsigned long)bf->width;  // load and copy of the row
+  PIXADD += (unsigned long)bf->width;
+}
+
+// Check if the window of the next output row has been received entirely.
+static int boxReady(const struct boxFilter* bf) {
+  return bf->nout < bf->end && (bf->nout + bf->dy < bf->nin || bf->nin == bf->height);
+}
+
+// Compute the next output row into out.
+// Requires: boxReady(bf).
+static void boxEmit(struct boxFilter* bf, uint8* out) {
+  int W = bf->width;
+  int dx = bf->dx;
+  int y = bf->nout++;
+  int y0 = max(0, y - bf->dy);
+  int y1 = min(y + bf->dy, bf->height - 1);
+
+  // Drop the rows that left the vertical window
+  for (; bf->lo < y0; bf->lo++) {
+    const uint8* old = bf->ring + (size_t)(bf->lo % bf->nring) * W;
+    for (int x = 0; x < W; ++x) {
+      bf->colsum[x] -= old[x];
+    }
+    PIXMEM += (unsigned long)W;
+    PIXADD += (unsigned long)W;
+  }
+
+  // Slide the horizontal window along the column sums
+  uint64_t h = (uint64_t)(y1 - y0 + 1);
+  uint64_t sum = 0;
+  for (int x = 0; x < min(dx, W); ++x) {
+    sum += bf->colsum[x];
+  }
+  uint64_t n = 0, d = 0;
+  double rcp = 0.0;
+  for (int x = 0; x < W; ++x) {
+    if (x + dx < W) sum += bf->colsum[x + dx];
+    if (x - dx - 1 >= 0) sum -= bf->colsum[x - dx - 1];
+
+    // The window width only changes near the left and right edges
+    uint64_t w = (uint64_t)(min(x + dx, W - 1) - max(0, x - dx) + 1);
+    if (w * h != n) {
+      n = w * h;
+      d = 2 * n;
+      rcp = 1.0 / (double)d;
+    }
+    uint64_t a = 2 * sum + n;
+    uint64_t q = (uint64_t)((double)a * rcp);
+    if (q * d > a) {
+      q--;
+    } else if ((q + 1) * d <= a) {
+      q++;
+    }
+    out[x] = (uint8)q;
+  }
+  PIXADD += 2 * (unsigned long)W;
+  PIXMEM += (unsigned long)W;  // store of the output row
+}
+
+// Parallel blur
+//
+// The output rows are split into nthreads bands of consecutive rows, each
+// filtered by a pool task with its own boxFilter.  A band also needs the
+// dy rows above it and the dy rows below it (its halo), but those belong to
+// the neighbouring bands, which overwrite them concurrently.  So the halo
+// rows are copied before any task starts, and each task reads its halo
+// from that copy and its own rows from the image.
+
+// Work of one band of the blur
+struct blurBand {
+  Image img;
+  int ya, yb;              // output rows [ya, yb)
+  struct boxFilter box;
+  uint8* halo;             // copy of input rows [ha, ya) and [yb, hb)
+  int ha, hb;
+};
+
+// Copy the halo rows of band b from the image.
+static void blurBandHalo(struct blurBand* b) {
+  Image img = b->img;
+  size_t w = (size_t)img->width;
+  uint8* dst = b->halo;
+  for (int y = b->ha; y < b->hb; ++y) {
+    if (y == b->ya) y = b->yb;  // skip own rows
+    if (y >= b->hb) break;
+    memcpy(dst, img->pixel + (size_t)y * img->stride, w);
+    dst += w;
+  }
+}
+
+// Filter band number i of the array arg (a pool task).
+static void blurBandRun(void* arg, int i) {
+  struct blurBand* b = (struct blurBand*)arg + i;
+  Image img = b->img;
+  size_t w = (size_t)img->width;
+  const uint8* halo = b->halo;
+
+  boxRange(&b->box, b->ya, b->yb);
+  for (int y = b->ha; y < b->hb; ++y) {
+    const uint8* row;
+    if (y < b->ya || y >= b->yb) {
+      row = halo;
+      halo += w;
+    } else {
+      row = img->pixel + (size_t)y * img->stride;
+    }
+    boxPush(&b->box, row);
+    while (boxReady(&b->box)) {
+      boxEmit(&b->box, img->pixel + (size_t)b->box.nout * img->stride);
+    }
+  }
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter, split in
+/// nthreads bands of consecutive rows, filtered by the worker threads.
+/// The result is exactly the same as ImageBlur's.
+/// Requires: dx >= 0, dy >= 0 and nthreads >= 1.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageBlurThreads(Image img, int dx, int dy, int nthreads) {  ///
   assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  assert(nthreads >= 1);
+
+  int H = img->height;
+  // Bands thinner than the window would mostly filter halo rows
+  nthreads = max(1, min(nthreads, H / (2 * dy + 1)));
+  int bandh = (H + nthreads - 1) / max(nthreads, 1);
+
+  struct blurBand* bands = calloc(nthreads, sizeof(struct blurBand));
+  int success = check(bands != NULL, "Memory allocation for blur bands failed");
+
+  // Prepare every band (and copy the halos) before any band is filtered
+  int nbands = 0;
+  for (int i = 0; success && i < nthreads && i * bandh < max(H, 1); ++i) {
+    struct blurBand* b = &bands[nbands];
+    b->img = img;
+    b->ya = i * bandh;
+    b->yb = min(H, b->ya + bandh);
+    b->ha = max(0, b->ya - dy);
+    b->hb = min(H, b->yb + dy);
+    size_t halorows = (size_t)(b->hb - b->ha) - (b->yb - b->ya);
+    success =
+        check((b->halo = malloc(halorows * img->width + 1)) != NULL, "Memory allocation for blur bands failed") &&
+        boxInit(&b->box, img->width, H, dx, dy);
+    if (b->halo != NULL) nbands++;
+    if (success) blurBandHalo(b);
+  }
 
-  // Each array entry is the cumulative sum of the pixel colors in the rectangle
-  // defined with the left top corner (0, 0) and the right bottom corner (i, j)
-  // Obs: uint32 should be enough for ~ 4100x4100 *white* image
-  uint32_t* pixels_sum = malloc(img->width * img->height * sizeof(uint32_t));
+  if (success) {
+    poolRun(nbands, blurBandRun, bands);
+    touch(img);
+  }
 
-  if (pixels_sum == NULL) {
-    fprintf(stderr, "ERROR: Failed to allocate memory for pixels sum array: %s\n", strerror(errno));
-    exit(1);
+  // Cleanup
+  errsave = errno;
+  for (int i = 0; bands != NULL && i < nbands; ++i) {
+    free(bands[i].halo);
+    boxFree(&bands[i].box);
+  }
+  free(bands);
+  errno = errsave;
+  return success;
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// Uses O(width * dy) extra memory per thread (see boxFilter above).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and the
+/// image is left unchanged.
+int ImageBlur(Image img, int dx, int dy) {  ///
+  return ImageBlurThreads(img, dx, dy, ImageThreads());
+}
+
+/// Streaming
+
+// Images larger than memory can be processed as a stream of rows:
+// the input PGM file is read one row at a time, each row is pushed through
+// a pipeline of stages, and rows leaving the last stage are appended to the
+// output file.  Each stage keeps only the rows it needs:
+//   - point operations (lookup tables) keep no rows at all;
+//   - crop keeps no rows, it just drops those outside the rectangle;
+//   - blur keeps the 2dy+2 rows around the current one (the halo) and a
+//     running sum of each column (see boxFilter).
+// So peak memory is O(width * (2dy+2)), independent of the image height.
+
+#define STREAM_MAXSTAGES 16
+
+enum { STAGE_LUT, STAGE_CROP, STAGE_BLUR };
+
+// A stage of the streaming pipeline
+struct streamStage {
+  int kind;           // STAGE_LUT, STAGE_CROP or STAGE_BLUR
+  int inw, inh;       // dimensions of the image entering the stage
+  int outw, outh;     // dimensions of the image leaving the stage
+  uint8 lut[256];     // STAGE_LUT: the table
+  int x, y;           // STAGE_CROP: top left corner of the rectangle
+  int dx, dy;         // STAGE_BLUR: window half sizes
+  struct boxFilter box;  // STAGE_BLUR: the filter (once running)
+  uint8* out;         // output row buffer (STAGE_LUT, STAGE_BLUR)
+  int nin, nout;      // rows received and rows emitted so far
+};
+
+// Internal structure of a stream
+struct imageStream {
+  FILE* in;           // input file, positioned at the first row
+  int width;          // dimensions of the input image
+  int height;
+  int maxval;
+  int nstages;
+  struct streamStage stage[STREAM_MAXSTAGES];
+  FILE* out;          // output file (only while running)
+};
+
+/// Open a raw PGM file for streaming.
+/// Only the header is read.  Operations are then added to the pipeline
+/// with the ImageStream* functions, and executed by ImageStreamRun.
+/// On success, a new stream is returned.
+/// (The caller is responsible for destroying the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) {  ///
+  int w, h;
+  int maxval;
+  char c;
+  FILE* f = NULL;
+  ImageStream s = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      // Parse PGM header
+      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
+      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      check((s = (ImageStream)calloc(1, sizeof(struct imageStream))) != NULL, "Memory allocation for ImageStream failed");
+
+  if (!success) {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    errno = errsave;
+    return NULL;
   }
 
-  int x, y;
+  s->in = f;
+  s->width = w;
+  s->height = h;
+  s->maxval = maxval;
+  s->nstages = 0;
+  return s;
+}
+
+/// Destroy the stream pointed to by (*sp), closing its input file.
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void ImageStreamDestroy(ImageStream* sp) {  ///
+  assert(sp != NULL);
+
+  ImageStream s = *sp;
+  if (s == NULL) return;
 
-  PIXMEM += 1;
-  pixels_sum[0] = ImageGetPixel(img, 0, 0);
-  // Calculate the first row of the matrix
-  for (x = 1; x < img->width; ++x) {
-    PIXADD += 1;
-    PIXMEM += 2;  // one store and one load for each iteration
-    pixels_sum[x] = ImageGetPixel(img, x, 0) + pixels_sum[x - 1];
+  errsave = errno;
+  for (int i = 0; i < s->nstages; ++i) {
+    if (s->stage[i].kind == STAGE_BLUR) boxFree(&s->stage[i].box);
+    free(s->stage[i].out);
   }
+  fclose(s->in);
+  free(s);
+  errno = errsave;
 
-  // Calculate the remaining rows of the cumulative sum matrix
-  for (y = 1; y < img->height; ++y) {
-    for (x = 0; x < img->width; ++x) {
-      PIXADD += 1;
-      PIXMEM += 2;  // one store and one load
-      pixels_sum[y * img->width + x] = ImageGetPixel(img, x, y) + pixels_sum[(y - 1) * img->width + x];
+  *sp = NULL;
+}
 
-      if (x != 0) {
-        PIXADD += 2;
-        PIXMEM += 3;  // one store and two loads
-        pixels_sum[y * img->width + x] += pixels_sum[y * img->width + x - 1] - pixels_sum[(y - 1) * img->width + x - 1];
-      }
+/// Get the width of the image leaving the stream pipeline (so far).
+int ImageStreamWidth(ImageStream s) {  ///
+  assert(s != NULL);
+  return s->nstages == 0 ? s->width : s->stage[s->nstages - 1].outw;
+}
+
+/// Get the height of the image leaving the stream pipeline (so far).
+int ImageStreamHeight(ImageStream s) {  ///
+  assert(s != NULL);
+  return s->nstages == 0 ? s->height : s->stage[s->nstages - 1].outh;
+}
+
+// Append a stage of the given kind, with same input and output dimensions.
+// Returns the new stage, or NULL (with errCause set) if the pipeline is full.
+static struct streamStage* addStage(ImageStream s, int kind) {
+  if (!check(s->nstages < STREAM_MAXSTAGES, "Too many stream operations")) {
+    return NULL;
+  }
+  struct streamStage* st = &s->stage[s->nstages];
+  memset(st, 0, sizeof(*st));
+  st->kind = kind;
+  st->inw = st->outw = ImageStreamWidth(s);
+  st->inh = st->outh = ImageStreamHeight(s);
+  s->nstages++;
+  return st;
+}
+
+/// Add a lookup table to the stream pipeline (see ImageApplyLUT).
+/// Requires: all entries of lut must be <= maxval.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errCause is set.
+int ImageStreamApplyLUT(ImageStream s, const uint8 lut[256]) {  ///
+  assert(s != NULL);
+  assert(lut != NULL);
+
+  // Consecutive tables are composed into one
+  if (s->nstages > 0 && s->stage[s->nstages - 1].kind == STAGE_LUT) {
+    uint8* prev = s->stage[s->nstages - 1].lut;
+    for (int v = 0; v < 256; ++v) {
+      prev[v] = lut[prev[v]];
     }
+    return 1;
   }
 
-  int x0, y0, x1, y1, x2, y2, x3, y3, w, h;
+  struct streamStage* st = addStage(s, STAGE_LUT);
+  if (st == NULL) return 0;
+  memcpy(st->lut, lut, sizeof(st->lut));
+  return 1;
+}
 
-  // For each image pixel, calculate the average pixel color inside the blur rectangle
-  for (y = 0; y < img->height; ++y) {
-    for (x = 0; x < img->width; ++x) {
-      // Top left corner
-      x0 = max(0, x - dx);
-      y0 = max(0, y - dy);
+/// Add ImageNegative to the stream pipeline.
+int ImageStreamNegative(ImageStream s) {  ///
+  assert(s != NULL);
+  uint8 lut[256];
+  negativeLUT(s->maxval, lut);
+  return ImageStreamApplyLUT(s, lut);
+}
 
-      // Bottom right
-      x1 = min(x + dx, img->width - 1);
-      y1 = min(y + dy, img->height - 1);
+/// Add ImageThreshold to the stream pipeline.
+int ImageStreamThreshold(ImageStream s, uint8 thr) {  ///
+  assert(s != NULL);
+  uint8 lut[256];
+  thresholdLUT(s->maxval, thr, lut);
+  return ImageStreamApplyLUT(s, lut);
+}
+
+/// Add ImageBrighten to the stream pipeline.
+int ImageStreamBrighten(ImageStream s, double factor) {  ///
+  assert(s != NULL);
+  assert(factor >= 0.0);
+  uint8 lut[256];
+  brightenLUT(s->maxval, factor, lut);
+  return ImageStreamApplyLUT(s, lut);
+}
 
-      // Top right
-      x2 = x1;
-      y2 = y0;
+/// Add ImageCrop to the stream pipeline.
+/// Requires: the rectangle must be inside the image entering this stage
+/// (same condition as ImageValidRect).
+int ImageStreamCrop(ImageStream s, int x, int y, int w, int h) {  ///
+  assert(s != NULL);
+  assert(w >= 0 && h >= 0);
+  assert(0 <= x && x + w <= ImageStreamWidth(s));
+  assert(0 <= y && y + h <= ImageStreamHeight(s));
+
+  struct streamStage* st = addStage(s, STAGE_CROP);
+  if (st == NULL) return 0;
+  st->x = x;
+  st->y = y;
+  st->outw = w;
+  st->outh = h;
+  return 1;
+}
 
-      // Bottom left
-      x3 = x0;
-      y3 = y1;
+/// Add ImageBlur to the stream pipeline.
+/// The result is the same as ImageBlur's (same filter, see boxFilter).
+int ImageStreamBlur(ImageStream s, int dx, int dy) {  ///
+  assert(s != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  struct streamStage* st = addStage(s, STAGE_BLUR);
+  if (st == NULL) return 0;
+  st->dx = dx;
+  st->dy = dy;
+  return 1;
+}
 
-      // Needed to calculate the number of pixels in the rectangle to calc the average color of the blurred pixel
-      w = x1 - x0 + 1;
-      h = y1 - y0 + 1;
+static int pushRow(ImageStream s, int i, const uint8* row);
 
-      // Considering the cumulative sum matrix above, the sum of the pixel colors inside the rectangle is equal to
-      // bottom right corner - bottom left corner - top right corner + top left corner
-      // we add the top left corner, because that sum is subtracted twice (bottom left corner and top right corner)
-      PIXMEM += 1;
-      uint32_t sum = pixels_sum[y1 * img->width + x1];
-
-      // Subtract top right corner
-      if (y2 != 0) {
-        PIXADD += 1;
-        PIXMEM += 1;
-        sum -= pixels_sum[(y2 - 1) * img->width + x2];
-      }
-      // Subtract bottom left corner
-      if (x3 != 0) {
-        PIXADD += 1;
-        PIXMEM += 1;
-        sum -= pixels_sum[y3 * img->width + x3 - 1];
-      }
-      // Re-add top left corner
-      if (x0 != 0 && y0 != 0) {
-        PIXADD += 1;
-        PIXMEM += 1;
-        sum += pixels_sum[(y0 - 1) * img->width + x0 - 1];
+// Push input row number st->nin into stage i (or to the output file,
+// if i is past the last stage).  Returns nonzero on success.
+static int pushRow(ImageStream s, int i, const uint8* row) {
+  if (i == s->nstages) {
+    size_t w = (size_t)ImageStreamWidth(s);
+    PIXMEM += (unsigned long)w;
+    return check(fwrite(row, sizeof(uint8), w, s->out) == w, "Writing pixels failed");
+  }
+
+  struct streamStage* st = &s->stage[i];
+  int y = st->nin++;
+
+  switch (st->kind) {
+    case STAGE_LUT:
+      memcpy(st->out, row, st->inw);
+      applyLUTSpan(st->out, st->inw, st->lut);
+      PIXMEM += (unsigned long)st->inw;
+      return pushRow(s, i + 1, st->out);
+
+    case STAGE_CROP:
+      if (y < st->y || y >= st->y + st->outh) return 1;
+      return pushRow(s, i + 1, row + st->x);
+
+    case STAGE_BLUR: {
+      boxPush(&st->box, row);
+      // Emit every output row whose window is now complete
+      int success = 1;
+      while (success && boxReady(&st->box)) {
+        boxEmit(&st->box, st->out);
+        st->nout++;
+        success = pushRow(s, i + 1, st->out);
       }
-      uint8 blurred_pixel = round((double)sum / (w * h));
-      ImageSetPixel(img, x, y, blurred_pixel);
+      return success;
     }
   }
+  return 0;
+}
 
-  free(pixels_sum);
-}
\ No newline at end of file
+/// Run the stream pipeline, writing the result to a PGM file.
+/// The input is read and the output written one row at a time.
+/// A stream can only be run once.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamRun(ImageStream s, const char* filename) {  ///
+  assert(s != NULL);
+
+  // Allocate the row buffers of each stage
+  int success = 1;
+  for (int i = 0; i < s->nstages && success; ++i) {
+    struct streamStage* st = &s->stage[i];
+    size_t w = (size_t)st->inw;
+    if (st->kind == STAGE_LUT) {
+      success = check((st->out = malloc(w)) != NULL, "Memory allocation for stream buffers failed");
+    } else if (st->kind == STAGE_BLUR) {
+      success =
+          check((st->out = malloc(w)) != NULL, "Memory allocation for stream buffers failed") &&
+          boxInit(&st->box, st->inw, st->inh, st->dx, st->dy);
+    }
+  }
+
+  uint8* row = NULL;
+  size_t w = (size_t)s->width;
+  s->out = NULL;
+  success = success &&
+      check((row = malloc(w > 0 ? w : 1)) != NULL, "Memory allocation for stream buffers failed") &&
+      check((s->out = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(s->out, "P5\n%d %d\n%u\n", ImageStreamWidth(s), ImageStreamHeight(s), s->maxval) > 0, "Writing header failed");
+
+  for (int y = 0; y < s->height && success; ++y) {
+    PIXMEM += (unsigned long)w;
+    success =
+        check(fread(row, sizeof(uint8), w, s->in) == w, "Reading pixels") &&
+        pushRow(s, 0, row);
+  }
+
+  // Cleanup
+  errsave = errno;
+  free(row);
+  if (s->out != NULL) fclose(s->out);
+  s->out = NULL;
+  errno = errsave;
+  return success;
+}
@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +24,23 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type ImageArena is a pointer to a group of images destroyed together
+typedef struct imageArena *ImageArena;
+
+// A pixel position
+typedef struct {
+  int x, y;
+} ImagePos;
+
+// A growable array of positions.
+// Start with an all-zero list; functions that fill it append to pos,
+// reallocating it as needed.  Release it with free(list.pos).
+typedef struct {
+  ImagePos* pos;
+  int count;     // number of positions in pos
+  int capacity;  // number of positions allocated
+} ImagePosList;
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,11 +54,60 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters, and start the worker threads (see
+/// ImageSetThreads).  Instrumentation is calibrated only when first
+/// needed (see InstrCalibrateOnce).
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations to n (n >= 1).
+/// n == 1 makes every operation run serially in the calling thread.
+/// ImageInit sets it from the IMAGE_THREADS environment variable, or to the
+/// number of processors if that is not set.
+/// Results never depend on the number of threads.
+void ImageSetThreads(int n) ;
+
+/// Number of threads used by image operations.
+int ImageThreads(void) ;
+
 /// Image management functions
 
+/// Images are allocated as a single block (structure and pixels), and
+/// destroyed images are kept in a pool for reuse by later images of
+/// similar size.  The "poolhit" and "poolmiss" instrumentation counters
+/// count the allocations served by the pool and by the system.
+
+/// Set the most bytes of destroyed images kept in the pool for reuse
+/// (256 MiB by default).  Blocks beyond the new limit are freed at once.
+/// bytes == 0 disables the pool.
+void ImagePoolSetLimit(size_t bytes) ;
+
+/// Return all blocks kept in the pool to the system.
+/// Useful after a burst of large images, when memory is needed elsewhere.
+/// The pool keeps recycling the images destroyed afterwards.
+void ImagePoolTrim(void) ;
+
+/// Create an empty arena.
+/// While an arena is in use by a thread (see ImageArenaUse), every image
+/// created by that thread belongs to it, and ImageArenaRelease destroys
+/// all of them at once.
+///
+/// On success, a new arena is returned.
+/// (The caller is responsible for releasing the returned arena!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageArena ImageArenaCreate(void) ;
+
+/// Make the images created from now on by the calling thread belong to
+/// arena (or to no arena, if arena is NULL).
+/// Returns the arena that was in use before.
+ImageArena ImageArenaUse(ImageArena arena) ;
+
+/// Destroy all images still in the arena pointed to by (*ap), then the
+/// arena itself.  Images of the arena must not be used afterwards.
+/// If (*ap)==NULL, no operation is performed.
+/// Ensures: (*ap)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void ImageArenaRelease(ImageArena* ap) ;
+
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
@@ -58,6 +125,22 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Create a view of a rectangular region of img.
+/// The view has width w and height h and shares the pixels of img:
+/// no pixels are copied, and changes made through either image are
+/// visible in the other.  A view may be used wherever an Image is expected.
+/// Requires:
+///   The rectangle must be inside the original image.
+///   The view must be destroyed (with ImageDestroy) before img.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
+/// Check if img is a view of another image.
+int ImageIsView(Image img) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,6 +150,19 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Map a raw PGM file into memory.
+/// Like ImageLoad, but the pixels are not read:  the file is mapped into
+/// memory and pages are only read when first accessed, so loading is almost
+/// instant, even for huge files.
+///   writable: if 0, the mapping is read-only;  otherwise, it is a private
+///   copy-on-write mapping, and changes to the image never reach the file.
+/// Requires: a read-only mapped image must not be modified.
+/// On systems without mmap, this is the same as ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename, int writable) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -91,8 +187,17 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (Both are 0 for an empty image.)
+/// The statistics of an image are cached until its pixels change,
+/// so repeated calls take constant time.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Pixel histogram
+/// On return, hist[v] is the number of pixels of img with level v,
+/// for every v in [0, 255].
+/// Cached like ImageStats.
+void ImageHistogram(Image img, uint64_t hist[256]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -119,6 +224,13 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+/// Apply a lookup table to image.
+/// Each pixel level v is replaced by lut[v].
+/// This is the common engine behind the pixel transformations below, and
+/// may be used to apply any other point operation in a single pass.
+/// Requires: all entries of lut must be <= maxval.
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
@@ -135,6 +247,31 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Equalize the histogram of image.
+/// Spread the gray levels of img over [0, maxval] so that their cumulative
+/// distribution becomes (nearly) linear, which raises the contrast of the
+/// levels that occur most.
+/// The histogram comes from the statistics cache (see ImageStats), and the
+/// result is applied as a single lookup table pass.
+void ImageEqualize(Image img) ;
+
+/// Apply threshold to image, at the level chosen by Otsu's method.
+/// The threshold thr maximizes the between-class variance of the two
+/// classes of pixels (level<thr and level>=thr), which best separates the
+/// dark and light pixels of bimodal images.  Then the image is thresholded
+/// as in ImageThreshold, with a single lookup table pass.
+/// Returns thr.  (An image with a single level is turned white.)
+uint8 ImageThresholdOtsu(Image img) ;
+
+/// Lookup tables of the pixel transformations above.
+/// Each function fills lut with the table that the corresponding
+/// transformation would apply to img, without touching the pixels.
+/// Tables may be composed (c[v] = b[a[v]]) to chain several
+/// transformations into a single ImageApplyLUT pass.
+void ImageNegativeLUT(Image img, uint8 lut[256]) ;
+void ImageThresholdLUT(Image img, uint8 thr, uint8 lut[256]) ;
+void ImageBrightenLUT(Image img, double factor, uint8 lut[256]) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +292,33 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image clockwise.
+/// Returns a version of the image rotated 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateCW(Image img) ;
+
+/// Rotate an image by 180 degrees.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Transpose an image.
+/// Returns the image reflected about its main diagonal:
+/// pixel (x,y) of img becomes pixel (y,x) of the result.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTranspose(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -184,33 +348,172 @@ Image ImageCrop(Image img, int x, int y, int w, int h) ;
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
+/// img2 may view pixels of img1, even inside that region:  the result is
+/// the same as if img2 had been copied first.
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
+/// img2 may view pixels of img1, even inside that region:  the result is
+/// the same as if img2 had been copied first.
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Blend several images into a larger image, in a single pass.
+/// The result is the same as calling ImageBlend(img1, xs[i], ys[i],
+/// layers[i], alphas[i]) for i = 0, 1, ..., n-1, in that order, but img1
+/// is swept only once, instead of once per layer.
+/// (If a layer views pixels of img1, the layers are blended one at a time.)
+/// This modifies img1 in-place.  It never fails.
+/// Requires: each layers[i] must fit inside img1 at position (xs[i], ys[i]).
+void ImageBlendMany(Image img1, int n, Image layers[], const int xs[], const int ys[], const double alphas[]) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
+/// Requires: img2 must fit inside img1 at pos (x, y).
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Positions are scanned column by column (x outer, y inner), so the match
+/// found is the one with the smallest x, and then the smallest y.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and appends every matching position to
+/// list, in raster order (by y, then by x).
+/// If first is nonzero, only the match that ImageLocateSubImage would find
+/// (smallest x, then smallest y) is appended, if any.
+/// The search is split across the threads of the library.
+/// On success, returns 1 (even if nothing is found).
+/// On failure (memory allocation), returns 0, errno/errCause are set
+/// accordingly, and list is left as it was.
+int ImageLocateAll(Image img1, Image img2, ImagePosList* list, int first) ;
+
+/// Locate all occurrences of several subimages inside another image.
+/// Searches for each of the n images subs[i] inside img1, and appends every
+/// matching position of subs[i] to found[i], in raster order (by y, then
+/// by x), as ImageLocateAll would.  The image is scanned only once.
+/// On success, returns 1 (even if nothing is found).
+/// On failure (memory allocation), returns 0, errno/errCause are set
+/// accordingly, and the found lists are left as they were.
+int ImageLocateMany(Image img1, int n, Image subs[], ImagePosList found[]) ;
+
+/// Image pyramids
+
+// Type ImagePyramid is a pointer to a stack of successively halved
+// versions of an image, used to speed up repeated searches in it.
+typedef struct imagePyramid *ImagePyramid;
+
+/// Create the pyramid of img, with up to nlevels levels (nlevels >= 1).
+/// Level 0 is img itself and each further level is half the size of the
+/// previous one (rounding down), stopping before levels become empty.
+/// img must not be changed or destroyed while the pyramid is in use.
+///
+/// On success, a new pyramid is returned.
+/// (The caller is responsible for destroying the returned pyramid!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePyramid ImagePyramidCreate(Image img, int nlevels) ;
+
+/// Destroy the pyramid pointed to by (*pp) (but not its base image).
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void ImagePyramidDestroy(ImagePyramid* pp) ;
+
+/// Number of levels of pyramid p.
+int ImagePyramidLevels(ImagePyramid p) ;
+
+/// Level k of pyramid p (level 0 is the base image).
+/// The image belongs to the pyramid:  do not modify or destroy it.
+Image ImagePyramidLevel(ImagePyramid p, int k) ;
+
+/// Locate a subimage inside the base image of a pyramid.
+/// The result is exactly that of ImageLocateSubImage(base image, ...), but
+/// candidate positions are first filtered at a coarse level of p.
+/// Building the pyramid (and the index each level gets on first use) is
+/// paid once, and then amortized over all subimages searched in it.
+int ImageLocatePyramid(ImagePyramid p, int* px, int* py, Image img2) ;
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches img1 for the position where img2 has the least sum of squared
+/// differences (SSD) to the pixels it covers.
+/// Ties are resolved as in ImageLocateSubImage (smallest x, then smallest y).
+/// Requires: img2 must not be larger than img1.
+/// On success, returns 1, the position is set in (*px, *py) and its SSD
+/// in *pscore (0 for an exact match).
+/// On failure (memory allocation), returns 0 and errno/errCause are set
+/// accordingly.
+int ImageLocateBest(Image img1, Image img2, int* px, int* py, uint64_t* pscore) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// Requires: dx >= 0 and dy >= 0.
+/// On success, returns nonzero.
+/// On failure (memory allocation), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Blur an image, as ImageBlur, splitting it in nthreads bands of rows.
+/// The bands are filtered by the threads of the library (ImageSetThreads);
+/// ImageBlur uses one band per thread.
+/// The result is exactly the same as ImageBlur's.
+/// Requires: nthreads >= 1.
+int ImageBlurThreads(Image img, int dx, int dy, int nthreads) ;
+
+/// Streaming
+
+/// A stream processes a PGM file too large to load, one row at a time.
+/// Open the file with ImageStreamOpen, add operations to its pipeline,
+/// then ImageStreamRun writes the result to another file.
+/// Peak memory is proportional to the image width (times 2dy+2 for each
+/// blur), never to the image height.
+///
+/// Functions adding operations return nonzero on success, and 0 (with
+/// errCause set) if the pipeline is full.
+
+// Type ImageStream is a pointer to stream objects
+typedef struct imageStream *ImageStream;
+
+/// Open a raw PGM file for streaming.  Only the header is read.
+/// On success, a new stream is returned.
+/// (The caller is responsible for destroying the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) ;
+
+/// Destroy the stream pointed to by (*sp), closing its input file.
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void ImageStreamDestroy(ImageStream* sp) ;
+
+/// Get the size of the image leaving the stream pipeline (so far).
+int ImageStreamWidth(ImageStream s) ;
+int ImageStreamHeight(ImageStream s) ;
+
+/// Add operations to the stream pipeline.
+/// These have the same effect as the corresponding Image functions.
+/// Requires: crop rectangle must be inside the image entering the crop.
+int ImageStreamApplyLUT(ImageStream s, const uint8 lut[256]) ;
+int ImageStreamNegative(ImageStream s) ;
+int ImageStreamThreshold(ImageStream s, uint8 thr) ;
+int ImageStreamBrighten(ImageStream s, double factor) ;
+int ImageStreamCrop(ImageStream s, int x, int y, int w, int h) ;
+int ImageStreamBlur(ImageStream s, int dx, int dy) ;
+
+/// Run the stream pipeline, writing the result to a PGM file.
+/// A stream can only be run once.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamRun(ImageStream s, const char* filename) ;
 
 #endif
@@ -1,4 +1,4 @@
-// imageTest - A program that performs some image processing.
+// imageTest - A benchmark of the image8bit operations.
 //
 // This program is an example use of the image8bit module,
 // a programming project for the course AED, DETI / UA.PT
@@ -11,195 +11,472 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "error.h"
 #include "image8bit.h"
 #include "instrumentation.h"
 
-const char* IMAGES[] = {
-    "./test/dot.pgm",
-    "./test/square.pgm",
-    "./test/white.pgm",
-    "./test/white_sm.pgm",
-    "./test/subimg.pgm",
-    "./test/subimg_sm.pgm",
+// The slower blur variants are not part of the public interface
+void ImageBlur2(Image img, int dx, int dy);
+void ImageBlur3(Image img, int dx, int dy);
+
+static const char* USAGE =
+    "USAGE: imageTest [-r REPS] [-w WARMUP] [-f FILTER] [-c FILE.csv] [-j FILE.json] [-h]\n"
+    "  Benchmark the image operations over a matrix of image sizes and\n"
+    "  parameters, and print a summary table (times per pixel are per pixel\n"
+    "  of the benchmarked image, whatever the size of auxiliary images).\n"
+    "  -r REPS      timed repetitions of each case (default 11)\n"
+    "  -w WARMUP    untimed repetitions before those (default 2)\n"
+    "  -f FILTER    only run the cases whose operation name contains FILTER\n"
+    "  -c FILE.csv  also write the results to a CSV file\n"
+    "  -j FILE.json also write the results to a JSON file\n";
+
+// Benchmark cases
+//
+// A case runs one operation, with up to two integer parameters, on an image
+// of a given size (with a fixed pseudo-random pattern), and optionally on
+// an auxiliary image, with the default number of library threads or a given
+// one.  Each operation registers its cases (see the register functions
+// below) over a matrix of sizes and parameters.
+
+typedef struct benchCase BenchCase;
+
+struct benchCase {
+  const char* op;     // operation name
+  char param[32];     // description of the parameters
+  int w, h;           // image size
+  int arg[2];         // parameters
+  int threads;        // library threads to run with (0: the default)
+  double bytes;       // bytes read and written per run, to report the
+                      // throughput (0: not reported)
+  // Build the auxiliary image of the case (may be NULL)
+  Image (*aux)(const BenchCase* c, Image img);
+  // Run the operation once.  Returns an image to destroy, or NULL.
+  Image (*run)(const BenchCase* c, Image img, Image aux);
 };
 
-const char* IMAGES2[] = {
-    "./pgm/large/ireland_03_1600x1200.pgm",
-    "./pgm/medium/airfield-05_640x480.pgm",
-    "./pgm/small/bird_256x256.pgm",
+#define MAXCASES 1024
+
+static BenchCase cases[MAXCASES];
+static int ncases = 0;
+
+// Register a case (with the default number of threads), and return it.
+static BenchCase* benchAdd(const char* op, int w, int h, int a0, int a1, const char* param,
+                           Image (*aux)(const BenchCase*, Image), Image (*run)(const BenchCase*, Image, Image)) {
+  assert(ncases < MAXCASES);
+  BenchCase* c = &cases[ncases++];
+  c->op = op;
+  snprintf(c->param, sizeof(c->param), "%s", param);
+  c->w = w;
+  c->h = h;
+  c->arg[0] = a0;
+  c->arg[1] = a1;
+  c->threads = 0;
+  c->bytes = 0.0;
+  c->aux = aux;
+  c->run = run;
+  return c;
+}
+
+// Image sizes of the matrix
+static const int SIZES[][2] = {{256, 256}, {640, 480}, {1600, 1200}, {3840, 2160}};
+#define NSIZES ((int)(sizeof(SIZES) / sizeof(SIZES[0])))
+
+// A larger size, for the geometric transformations (which must stay fast
+// well beyond the cache sizes)
+static const int SIZE_8K[2] = {7680, 4320};
+
+// Create a w x h image with a fixed pseudo-random pattern.
+static Image patternImage(int w, int h, unsigned seed) {
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) {
+    error(2, errno, "Creating %dx%d image: %s", w, h, ImageErrMsg());
+  }
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 16));
+    }
+  }
+  return img;
+}
+
+// Copy of the w x h rectangle of img at (x, y).
+static Image copyRect(Image img, int x, int y, int w, int h) {
+  Image sub = ImageCreate(w, h, ImageMaxval(img));
+  if (sub == NULL) {
+    error(2, errno, "Creating %dx%d image: %s", w, h, ImageErrMsg());
+  }
+  for (int j = 0; j < h; ++j) {
+    for (int i = 0; i < w; ++i) {
+      ImageSetPixel(sub, i, j, ImageGetPixel(img, x + i, y + j));
+    }
+  }
+  return sub;
+}
+
+// Auxiliary images
+
+// A quarter-size image with another pattern (to paste or blend).
+static Image auxLayer(const BenchCase* c, Image img) {
+  (void)img;
+  return patternImage(c->w / 4, c->h / 4, 7);
+}
+
+// An arg[0] x arg[0] subimage of img, from near its bottom right corner
+// (so that searches have to scan most of img).
+static Image auxSubimage(const BenchCase* c, Image img) {
+  int s = c->arg[0];
+  return copyRect(img, c->w - s - 1, c->h - s - 1, s, s);
+}
+
+// Operations
+
+static Image runNegative(const BenchCase* c, Image img, Image aux) {
+  (void)c;
+  (void)aux;
+  ImageNegative(img);
+  return NULL;
+}
+
+static Image runEqualize(const BenchCase* c, Image img, Image aux) {
+  (void)c;
+  (void)aux;
+  ImageEqualize(img);
+  return NULL;
+}
+
+static Image runBlur(const BenchCase* c, Image img, Image aux) {
+  (void)aux;
+  if (!ImageBlur(img, c->arg[0], c->arg[1])) {
+    error(2, errno, "ImageBlur: %s", ImageErrMsg());
+  }
+  return NULL;
+}
+
+static Image runBlur2(const BenchCase* c, Image img, Image aux) {
+  (void)aux;
+  ImageBlur2(img, c->arg[0], c->arg[1]);
+  return NULL;
+}
+
+static Image runBlur3(const BenchCase* c, Image img, Image aux) {
+  (void)aux;
+  ImageBlur3(img, c->arg[0], c->arg[1]);
+  return NULL;
+}
+
+// Geometric transformations, by index in GEOMETRIC
+static struct {
+  const char* name;
+  Image (*op)(Image);
+} GEOMETRIC[] = {
+    {"rotate", ImageRotate},       {"rotatecw", ImageRotateCW}, {"rotate180", ImageRotate180},
+    {"transpose", ImageTranspose}, {"mirror", ImageMirror},
 };
+#define NGEOMETRIC ((int)(sizeof(GEOMETRIC) / sizeof(GEOMETRIC[0])))
+
+static Image runGeometric(const BenchCase* c, Image img, Image aux) {
+  (void)aux;
+  Image r = GEOMETRIC[c->arg[0]].op(img);
+  if (r == NULL) {
+    error(2, errno, "%s: %s", c->op, ImageErrMsg());
+  }
+  return r;
+}
+
+static Image runPaste(const BenchCase* c, Image img, Image aux) {
+  (void)c;
+  ImagePaste(img, 1, 1, aux);
+  return NULL;
+}
+
+// arg[0] is alpha in percent
+static Image runBlend(const BenchCase* c, Image img, Image aux) {
+  ImageBlend(img, 1, 1, aux, c->arg[0] / 100.0);
+  return NULL;
+}
+
+static Image runLocate(const BenchCase* c, Image img, Image aux) {
+  (void)c;
+  int x, y;
+  if (!ImageLocateSubImage(img, &x, &y, aux)) {
+    error(2, 0, "ImageLocateSubImage: subimage not found");
+  }
+  return NULL;
+}
+
+static Image runLocateAll(const BenchCase* c, Image img, Image aux) {
+  (void)c;
+  ImagePosList found = {NULL, 0, 0};
+  if (!ImageLocateAll(img, aux, &found, 0)) {
+    error(2, errno, "ImageLocateAll: %s", ImageErrMsg());
+  }
+  free(found.pos);
+  return NULL;
+}
 
-void test_locate_subimage() {
-  printf("# LOAD image\n");
-  InstrReset();  // to reset instrumentation
-  Image dot = ImageLoad(IMAGES[0]);
-  Image square = ImageLoad(IMAGES[1]);
-  Image white = ImageLoad(IMAGES[2]);
-  Image white_sm = ImageLoad(IMAGES[3]);
-  Image subimg = ImageLoad(IMAGES[4]);
-  Image subimg_sm = ImageLoad(IMAGES[5]);
-
-  if (dot == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES[0], ImageErrMsg());
-  }
-  if (square == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES[1], ImageErrMsg());
-  }
-  if (white == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES[2], ImageErrMsg());
-  }
-  if (white_sm == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES[2], ImageErrMsg());
-  }
-  if (subimg == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES[3], ImageErrMsg());
-  }
-  if (subimg_sm == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES[3], ImageErrMsg());
-  }
-  InstrPrint();  // to print instrumentation
-
-  int px, py;
-
-  // PIXCMP should be 2
-  printf("# LOCATE image best case #1 (200x200) (1x1)\n");
-  InstrReset();  // to reset instrumentation
-  ImageLocateSubImage(square, &px, &py, dot);
-  InstrPrint();  // to print instrumentation
-
-  // PIXCMP should be 2
-  printf("# LOCATE image best case #2 (200x200) (200x200)\n");
-  InstrReset();  // to reset instrumentation
-  ImageLocateSubImage(white, &px, &py, square);
-  InstrPrint();  // to print instrumentation
-
-  // PIXCMP should be ... bad
-  printf("# LOCATE image worst case #1 (100x100) (50x50)\n");
-  InstrReset();  // to reset instrumentation
-  ImageLocateSubImage(white_sm, &px, &py, subimg_sm);
-  InstrPrint();  // to print instrumentation
-
-  // PIXCMP should be ... bad
-  printf("# LOCATE image worst case #1 (200x200) (100x100)\n");
-  InstrReset();  // to reset instrumentation
-  ImageLocateSubImage(white, &px, &py, subimg);
-  InstrPrint();  // to print instrumentation
-
-  // PIXCMP should be ... not too bad but still bad
-  printf("# LOCATE image worst case #2 (200x200) (200x200)\n");
-  InstrReset();  // to reset instrumentation
-  ImageLocateSubImage(white, &px, &py, white);
-  InstrPrint();  // to print instrumentation
-
-  // PIXCMP should be ... not too bad but still bad
-  printf("# LOCATE image worst case #2 (100x100) (100x100)\n");
-  InstrReset();  // to reset instrumentation
-  ImageLocateSubImage(white_sm, &px, &py, white_sm);
-  InstrPrint();  // to print instrumentation
-
-  // Cleanup
-  ImageDestroy(&dot);
-  ImageDestroy(&square);
-  ImageDestroy(&white);
-  ImageDestroy(&white_sm);
-  ImageDestroy(&subimg);
-  ImageDestroy(&subimg_sm);
-}
-
-void test_blur() {
-  printf("# LOAD image\n");
-  InstrReset();  // to reset instrumentation
-  Image large = ImageLoad(IMAGES2[0]);
-  Image medium = ImageLoad(IMAGES2[1]);
-  Image small = ImageLoad(IMAGES2[2]);
-
-  if (large == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES2[0], ImageErrMsg());
-  }
-  if (medium == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES2[1], ImageErrMsg());
-  }
-  if (small == NULL) {
-    error(2, errno, "Loading %s: %s", IMAGES2[2], ImageErrMsg());
-  }
-  InstrPrint();  // to print instrumentation
-
-  int dx = 40, dy = 20;
-  printf("# ImageBlur (Most optimized) (1600x1200) with blur window (40x20)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur(large, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur2 (Half optimized) (1600x1200) with blur window (40x20)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur2(large, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur3 (Not optimized) (1600x1200) with blur window (40x20)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur3(large, dx, dy);
-  InstrPrint();  // to print instrumentation
-
-  dx = 40, dy = 40;
-
-  printf("# ImageBlur (Most optimized) (640x480) with blur window (40x40)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur(medium, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur2 (Half optimized) (640x480) with blur window (40x40)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur2(medium, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur3 (Not optimized) (640x480) with blur window (40x40)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur3(medium, dx, dy);
-  InstrPrint();  // to print instrumentation
-
-  dx = 20, dy = 20;
-
-  printf("# ImageBlur (Most optimized) (640x480) with blur window (20x20)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur(medium, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur2 (Half optimized) (640x480) with blur window (20x20)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur2(medium, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur3 (Not optimized) (640x480) with blur window (20x20)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur3(medium, dx, dy);
-  InstrPrint();  // to print instrumentation
-
-  dx = 4, dy = 2;
-
-  printf("# ImageBlur (Most optimized) (256x256) with blur window (4x2)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur(small, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur2 (Half optimized) (256x256) with blur window (4x2)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur2(small, dx, dy);
-  InstrPrint();  // to print instrumentation
-  printf("# ImageBlur3 (Not optimized) (256x256) with blur window (4x2)\n");
-  InstrReset();  // to reset instrumentation
-  ImageBlur3(small, dx, dy);
-  InstrPrint();  // to print instrumentation
-
-  ImageDestroy(&large);
-  ImageDestroy(&medium);
-  ImageDestroy(&small);
+static Image runLocateBest(const BenchCase* c, Image img, Image aux) {
+  (void)c;
+  int x, y;
+  uint64_t score;
+  if (!ImageLocateBest(img, aux, &x, &y, &score)) {
+    error(2, errno, "ImageLocateBest: %s", ImageErrMsg());
+  }
+  return NULL;
+}
+
+// Registry
+
+static void registerPoint(void) {
+  for (int s = 0; s < NSIZES; ++s) {
+    benchAdd("negative", SIZES[s][0], SIZES[s][1], 0, 0, "", NULL, runNegative);
+    benchAdd("equalize", SIZES[s][0], SIZES[s][1], 0, 0, "", NULL, runEqualize);
+  }
+}
+
+static void registerBlur(void) {
+  const int windows[][2] = {{4, 2}, {20, 20}, {40, 20}};
+  char param[32];
+  for (int s = 0; s < 3; ++s) {
+    for (int k = 0; k < 3; ++k) {
+      int dx = windows[k][0], dy = windows[k][1];
+      snprintf(param, sizeof(param), "dx=%d dy=%d", dx, dy);
+      benchAdd("blur", SIZES[s][0], SIZES[s][1], dx, dy, param, NULL, runBlur);
+      benchAdd("blur2", SIZES[s][0], SIZES[s][1], dx, dy, param, NULL, runBlur2);
+      // The naive blur costs O(dx*dy) per pixel:  keep it small
+      if (s == 0) benchAdd("blur3", SIZES[s][0], SIZES[s][1], dx, dy, param, NULL, runBlur3);
+    }
+  }
+  // Scaling:  the same blur with 1, 2, ... threads, up to one per processor
+  long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int t = 1; t == 1 || (t <= nproc && ncases < MAXCASES); ++t) {
+    benchAdd("blurthreads", 1600, 1200, 40, 20, "dx=40 dy=20", NULL, runBlur)->threads = t;
+  }
+}
+
+// Each transformation reads and writes every pixel once:  its throughput
+// is reported for 2*w*h bytes.
+static void registerGeometric(void) {
+  for (int i = 0; i < NGEOMETRIC; ++i) {
+    for (int s = 1; s <= NSIZES; ++s) {
+      const int* size = s < NSIZES ? SIZES[s] : SIZE_8K;
+      benchAdd(GEOMETRIC[i].name, size[0], size[1], i, 0, "", NULL, runGeometric)->bytes =
+          2.0 * size[0] * size[1];
+    }
+  }
+}
+
+static void registerBlend(void) {
+  for (int s = 1; s < NSIZES; ++s) {
+    benchAdd("paste", SIZES[s][0], SIZES[s][1], 0, 0, "", auxLayer, runPaste);
+    benchAdd("blend", SIZES[s][0], SIZES[s][1], 33, 0, "alpha=0.33", auxLayer, runBlend);
+  }
+}
+
+static void registerLocate(void) {
+  char param[32];
+  for (int s = 1; s < 3; ++s) {
+    for (int sub = 16; sub <= 64; sub *= 4) {
+      snprintf(param, sizeof(param), "sub=%dx%d", sub, sub);
+      benchAdd("locate", SIZES[s][0], SIZES[s][1], sub, 0, param, auxSubimage, runLocate);
+      benchAdd("locateall", SIZES[s][0], SIZES[s][1], sub, 0, param, auxSubimage, runLocateAll);
+    }
+    snprintf(param, sizeof(param), "sub=%dx%d", 32, 32);
+    benchAdd("locatebest", SIZES[s][0], SIZES[s][1], 32, 0, param, auxSubimage, runLocateBest);
+  }
+}
+
+// Measurement
+
+typedef struct {
+  double wallMedian, wallP95, wallMean, wallStddev;
+  double cpuMedian;
+  double nsPerPixel;
+  unsigned long pixmem, pixcmp, pixadd;  // counters of the last repetition
+  int threads;     // library threads used
+  double speedup;  // wall median of the case with 1 thread over this one's
+                   // (cases with a given number of threads;  else NAN)
+  double gbps;     // GB/s moved, at the wall median (NAN if not reported)
+} BenchResult;
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Value at fraction q of the sorted array v[0..n-1] (nearest rank).
+static double quantile(const double* v, int n, double q) {
+  int k = (int)ceil(q * n) - 1;
+  return v[k < 0 ? 0 : k];
+}
+
+// Run case c warmup+reps times and summarize the timed repetitions.
+// Every repetition starts from the same pixels:  operations that modify
+// img in place get it restored from a pristine copy, untimed.
+static BenchResult benchRun(const BenchCase* c, int warmup, int reps) {
+  Image img = patternImage(c->w, c->h, 1);
+  Image pristine = patternImage(c->w, c->h, 1);
+  Image aux = c->aux != NULL ? c->aux(c, img) : NULL;
+  double* wall = malloc(reps * sizeof(double));
+  double* cpu = malloc(reps * sizeof(double));
+  if (wall == NULL || cpu == NULL) {
+    error(2, errno, "Allocating benchmark results");
+  }
+
+  int threads = ImageThreads();
+  if (c->threads > 0) {
+    ImageSetThreads(c->threads);
+  }
+  BenchResult r;
+  r.threads = ImageThreads();
+  for (int i = -warmup; i < reps; ++i) {
+    ImagePaste(img, 0, 0, pristine);
+    InstrReset();
+    double w0 = wall_time();
+    double c0 = cpu_time();
+    Image out = c->run(c, img, aux);
+    double c1 = cpu_time();
+    double w1 = wall_time();
+    ImageDestroy(&out);
+    if (i >= 0) {
+      wall[i] = w1 - w0;
+      cpu[i] = c1 - c0;
+    }
+  }
+  r.pixmem = InstrTotal(0);
+  r.pixcmp = InstrTotal(1);
+  r.pixadd = InstrTotal(2);
+  ImageSetThreads(threads);
+
+  double sum = 0.0, sum2 = 0.0;
+  for (int i = 0; i < reps; ++i) {
+    sum += wall[i];
+  }
+  r.wallMean = sum / reps;
+  for (int i = 0; i < reps; ++i) {
+    sum2 += (wall[i] - r.wallMean) * (wall[i] - r.wallMean);
+  }
+  r.wallStddev = reps > 1 ? sqrt(sum2 / (reps - 1)) : 0.0;
+  qsort(wall, reps, sizeof(double), cmpDouble);
+  qsort(cpu, reps, sizeof(double), cmpDouble);
+  r.wallMedian = quantile(wall, reps, 0.5);
+  r.wallP95 = quantile(wall, reps, 0.95);
+  r.cpuMedian = quantile(cpu, reps, 0.5);
+  r.nsPerPixel = r.wallMedian * 1e9 / ((double)c->w * c->h);
+  r.gbps = c->bytes > 0.0 ? c->bytes / r.wallMedian / 1e9 : NAN;
+
+  free(wall);
+  free(cpu);
+  ImageDestroy(&aux);
+  ImageDestroy(&pristine);
+  ImageDestroy(&img);
+  return r;
+}
+
+// Reports
+
+static const char* CSV_HEADER =
+    "op,param,width,height,reps,wall_median_s,wall_p95_s,wall_mean_s,wall_stddev_s,"
+    "cpu_median_s,ns_per_pixel,pixmem,pixcmp,pixadd,threads,speedup,gb_per_s\n";
+
+static void csvRow(FILE* f, const BenchCase* c, const BenchResult* r, int reps) {
+  fprintf(f, "%s,%s,%d,%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.4f,%lu,%lu,%lu,%d,", c->op, c->param, c->w, c->h, reps,
+          r->wallMedian, r->wallP95, r->wallMean, r->wallStddev, r->cpuMedian, r->nsPerPixel, r->pixmem,
+          r->pixcmp, r->pixadd, r->threads);
+  if (!isnan(r->speedup)) fprintf(f, "%.3f", r->speedup);
+  fputc(',', f);
+  if (!isnan(r->gbps)) fprintf(f, "%.3f", r->gbps);
+  fputc('\n', f);
+}
+
+static void jsonRow(FILE* f, const BenchCase* c, const BenchResult* r, int reps, int first) {
+  fprintf(f,
+          "%s\n  {\"op\": \"%s\", \"param\": \"%s\", \"width\": %d, \"height\": %d, \"reps\": %d, "
+          "\"wall_median_s\": %.9f, \"wall_p95_s\": %.9f, \"wall_mean_s\": %.9f, \"wall_stddev_s\": %.9f, "
+          "\"cpu_median_s\": %.9f, \"ns_per_pixel\": %.4f, \"pixmem\": %lu, \"pixcmp\": %lu, \"pixadd\": %lu, "
+          "\"threads\": %d",
+          first ? "" : ",", c->op, c->param, c->w, c->h, reps, r->wallMedian, r->wallP95, r->wallMean,
+          r->wallStddev, r->cpuMedian, r->nsPerPixel, r->pixmem, r->pixcmp, r->pixadd, r->threads);
+  if (!isnan(r->speedup)) fprintf(f, ", \"speedup\": %.3f", r->speedup);
+  if (!isnan(r->gbps)) fprintf(f, ", \"gb_per_s\": %.3f", r->gbps);
+  fputc('}', f);
+}
+
+static FILE* openReport(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) {
+    error(2, errno, "Opening %s", filename);
+  }
+  return f;
 }
 
 int main(int argc, char* argv[]) {
   program_name = argv[0];
 
+  int reps = 11, warmup = 2;
+  const char* filter = NULL;
+  const char* csvname = NULL;
+  const char* jsonname = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:w:f:c:j:h")) != -1) {
+    switch (opt) {
+      case 'h': fputs(USAGE, stdout); return 0;
+      case 'r': reps = atoi(optarg); break;
+      case 'w': warmup = atoi(optarg); break;
+      case 'f': filter = optarg; break;
+      case 'c': csvname = optarg; break;
+      case 'j': jsonname = optarg; break;
+      default: error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (optind < argc || reps < 1 || warmup < 0) {
+    error(1, 0, "\n%s", USAGE);
+  }
+
   ImageInit();
 
-  // test_locate_subimage();
-  test_blur();
+  registerPoint();
+  registerBlur();
+  registerGeometric();
+  registerBlend();
+  registerLocate();
+
+  FILE* csv = csvname != NULL ? openReport(csvname) : NULL;
+  FILE* json = jsonname != NULL ? openReport(jsonname) : NULL;
+  if (csv != NULL) fputs(CSV_HEADER, csv);
+  if (json != NULL) fputs("[", json);
+
+  printf("# %d threads, %d warmup + %d timed repetitions per case\n", ImageThreads(), warmup, reps);
+  printf("#%-11s %-14s %9s %12s %12s %10s %12s %9s %7s %7s %7s\n", "op", "param", "size", "wall med", "wall p95",
+         "stddev", "cpu med", "ns/pixel", "threads", "speedup", "GB/s");
+  int nrun = 0;
+  double serial = NAN;  // wall median of the last case run with 1 thread
+  for (int i = 0; i < ncases; ++i) {
+    const BenchCase* c = &cases[i];
+    if (filter != NULL && strstr(c->op, filter) == NULL) continue;
+    BenchResult r = benchRun(c, warmup, reps);
+    if (c->threads == 1) serial = r.wallMedian;
+    r.speedup = c->threads > 0 ? serial / r.wallMedian : NAN;
+    char size[24], speedup[16] = "", gbps[16] = "";
+    snprintf(size, sizeof(size), "%dx%d", c->w, c->h);
+    if (!isnan(r.speedup)) snprintf(speedup, sizeof(speedup), "%.2f", r.speedup);
+    if (!isnan(r.gbps)) snprintf(gbps, sizeof(gbps), "%.2f", r.gbps);
+    printf(" %-11s %-14s %9s %12.6f %12.6f %10.6f %12.6f %9.3f %7d %7s %7s\n", c->op, c->param, size, r.wallMedian,
+           r.wallP95, r.wallStddev, r.cpuMedian, r.nsPerPixel, r.threads, speedup, gbps);
+    fflush(stdout);
+    if (csv != NULL) csvRow(csv, c, &r, reps);
+    if (json != NULL) jsonRow(json, c, &r, reps, nrun == 0);
+    nrun++;
+  }
 
+  if (json != NULL) fputs("\n]\n", json);
+  if (csv != NULL) fclose(csv);
+  if (json != NULL) fclose(json);
   return 0;
 }
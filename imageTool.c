@@ -36,33 +36,61 @@ static const char* USAGE =
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
+    "  map FILE        Map PGM image file into memory (copy-on-write),\n"
+    "                  creating new image without reading its pixels yet\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  info            Show information on CURR (size and range) and\n"
+    "                  how many point operations were fused\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "                  (consecutive neg, thr and bri are fused into one pass)\n"
+    "  equalize        Equalize the histogram of CURR\n"
+    "  otsu            Apply thresholding to CURR at the level chosen by\n"
+    "                  Otsu's method, and print that level\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotatecw        Rotate CURR 90º clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  transpose       Transpose CURR (swap x and y), creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  view X,Y,W,H    View a rectangle of CURR, creating new image that\n"
+    "                  shares its pixels (changes to either affect both)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  plocate         Search PRED in CURR as locate, filtering positions first\n"
+    "                  in a pyramid of reduced versions of CURR\n"
+    "  locateall       Search PRED in CURR, print all matching positions\n"
+    "  locatemany N    Search each of the N images before CURR in CURR (in a\n"
+    "                  single pass), print all matching positions\n"
+    "  best            Search PRED in CURR for the closest match (least sum of\n"
+    "                  squared differences), print its position and SSD\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
     "\n"              
+    "STREAMING:\n"
+    "  imageTool stream FILE [OPERATION [OPERAND...]]... save FILE\n"
+    "  Process FILE one row at a time, without loading it whole, so that\n"
+    "  images larger than memory may be processed.  Only neg, thr, bri, crop\n"
+    "  and blur are accepted, and the pipeline must end with save.\n"
+    "\n"
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
     "\n"
+    "ENVIRONMENT:\n"
+    "  IMAGE_THREADS   Number of threads to use (default: one per processor)\n"
+    "\n"
     ;
 
 static char* errors[] = {
@@ -77,6 +105,12 @@ static char* errors[] = {
 };
 
 
+// Point operations (neg, thr, bri) only depend on each pixel level, so
+// consecutive ones are fused into a single lookup table pass.
+static int isPointOp(const char* op) {
+  return strcmp(op, "neg") == 0 || strcmp(op, "thr") == 0 || strcmp(op, "bri") == 0;
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -85,6 +119,64 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
+// Streaming mode:  imageTool stream FILE [OPERATION [OPERAND...]]... save FILE
+// Only point operations, crop and blur are accepted.
+// Returns an index into errors[].
+static int streamMain(int ac, char* av[]) {
+  int x, y, w, h;
+  int k = 2;
+  if (k >= ac) return 1;
+  fprintf(stderr, "Streaming %s\n", av[k]);
+  ImageStream s = ImageStreamOpen(av[k]);
+  if (s == NULL) return 4;
+
+  int err = 0;
+  int saved = 0;
+  for (k++; k < ac && err == 0; k++) {
+    if (strcmp(av[k], "neg") == 0) {
+      fprintf(stderr, "Negating\n");
+      if (!ImageStreamNegative(s)) err = 4;
+    } else if (strcmp(av[k], "thr") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      fprintf(stderr, "Thresholding at %d\n", thr);
+      if (!ImageStreamThreshold(s, thr)) err = 4;
+    } else if (strcmp(av[k], "bri") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      double factor;
+      if (sscanf(av[k], "%lf", &factor) != 1 || factor < 0.0) { err = 5; break; }
+      fprintf(stderr, "Brightening by %lf\n", factor);
+      if (!ImageStreamBrighten(s, factor)) err = 4;
+    } else if (strcmp(av[k], "crop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      // precondition check! (same as ImageValidRect)
+      if (x < 0 || y < 0 || w < 0 || h < 0 ||
+          x + w > ImageStreamWidth(s) || y + h > ImageStreamHeight(s)) { err = 5; break; }
+      fprintf(stderr, "Cropping (%d,%d,%d,%d)\n", x, y, w, h);
+      if (!ImageStreamCrop(s, x, y, w, h)) err = 4;
+    } else if (strcmp(av[k], "blur") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int dx, dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+      fprintf(stderr, "Blur with %dx%d mean filter\n", 2*dx+1, 2*dy+1);
+      if (!ImageStreamBlur(s, dx, dy)) err = 4;
+    } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Saving %s\n", av[k]);
+      if (!ImageStreamRun(s, av[k])) err = 4;
+      saved = 1;
+      break;
+    } else {
+      err = 5;
+    }
+  }
+  if (err == 0 && !saved) err = 1;
+  ImageStreamDestroy(&s);
+  return err;
+}
+
 int main(int ac, char* av[]) {
   program_name = av[0];
   if (ac <= 1) {
@@ -93,8 +185,20 @@ int main(int ac, char* av[]) {
 
   ImageInit();
 
+  if (strcmp(av[1], "stream") == 0) {
+    int err = streamMain(ac, av);
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+
   int err = 0;
   int x, y, w, h;
+  int pointOps = 0;     // point operations (neg, thr, bri) applied
+  int pointPasses = 0;  // passes over the pixels they took
+
+  // All images of the pipeline go into one arena, released at the end
+  ImageArena arena = ImageArenaCreate();
+  ImageArenaUse(arena);
 
   // The image buffer
   const int N = 10;   // buffer capacity
@@ -113,28 +217,54 @@ int main(int ac, char* av[]) {
       ImageStats(img[n-1], &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      printf("# Point ops: %d fused into %d passes\n", pointOps, pointPasses);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
+    } else if (isPointOp(av[k])) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
-      if (++k >= ac) { err = 1; break; }
+      // Compose this and any following point operations into a single
+      // lookup table, so that the whole run costs one pass over CURR.
+      uint8 lut[256];
+      for (int v = 0; v < 256; v++) lut[v] = (uint8)v;
+      int fused = 0;
+      while (k < ac && isPointOp(av[k])) {
+        uint8 op[256];
+        if (strcmp(av[k], "neg") == 0) {
+          fprintf(stderr, "Negating I%d\n", n-1);
+          ImageNegativeLUT(img[n-1], op);
+        } else if (strcmp(av[k], "thr") == 0) {
+          if (++k >= ac) { err = 1; break; }
+          uint8 thr;
+          if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+          fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
+          ImageThresholdLUT(img[n-1], (uint8)thr, op);
+        } else {  // bri
+          if (++k >= ac) { err = 1; break; }
+          double factor;
+          if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+          fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
+          ImageBrightenLUT(img[n-1], factor, op);
+        }
+        for (int v = 0; v < 256; v++) lut[v] = op[lut[v]];
+        fused++;
+        k++;
+      }
+      if (err) break;
+      k--;  // the main loop advances past the last operand
+      ImageApplyLUT(img[n-1], lut);
+      pointOps += fused;
+      pointPasses++;
+    } else if (strcmp(av[k], "equalize") == 0) {
       if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
-      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Equalizing I%d\n", n-1);
+      ImageEqualize(img[n-1]);
+    } else if (strcmp(av[k], "otsu") == 0) {
       if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      fprintf(stderr, "Thresholding I%d by Otsu's method\n", n-1);
+      uint8 thr = ImageThresholdOtsu(img[n-1]);
+      printf("# Otsu threshold: %hhu\n", thr);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
@@ -151,6 +281,27 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotatecw") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d clockwise -> I%d\n", n-1, n);
+      img[n] = ImageRotateCW(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d by 180º -> I%d\n", n-1, n);
+      img[n] = ImageRotate180(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "transpose") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Transposing I%d -> I%d\n", n-1, n);
+      img[n] = ImageTranspose(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -168,6 +319,16 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "view") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Viewing I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      img[n] = ImageView(img[n-1], x, y, w, h);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -195,13 +356,66 @@ int main(int ac, char* av[]) {
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "plocate") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in pyramid of I%d\n", n-2, n-1);
+      ImagePyramid pyr = ImagePyramidCreate(img[n-1], 8);
+      if (pyr == NULL) { err = 4; break; }
+      if (ImageLocatePyramid(pyr, &x, &y, img[n-2])) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+      ImagePyramidDestroy(&pyr);
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating all I%d in I%d\n", n-2, n-1);
+      ImagePosList found = {NULL, 0, 0};
+      if (!ImageLocateAll(img[n-1], img[n-2], &found, 0)) { err = 4; break; }
+      for (int i = 0; i < found.count; ++i) {
+        printf("# FOUND (%d,%d)\n", found.pos[i].x, found.pos[i].y);
+      }
+      printf("# %d FOUND\n", found.count);
+      free(found.pos);
+    } else if (strcmp(av[k], "locatemany") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int m;
+      if (sscanf(av[k], "%d", &m) != 1 || m < 0) { err = 5; break; }
+      if (n < m + 1) { err = 2; break; }
+      fprintf(stderr, "Locating I%d..I%d in I%d\n", n-1-m, n-2, n-1);
+      ImagePosList found[N];
+      memset(found, 0, sizeof(found));
+      int ok = ImageLocateMany(img[n-1], m, &img[n-1-m], found);
+      for (int i = 0; i < m; ++i) {
+        for (int j = 0; ok && j < found[i].count; ++j) {
+          printf("# I%d FOUND (%d,%d)\n", n-1-m+i, found[i].pos[j].x, found[i].pos[j].y);
+        }
+        free(found[i].pos);
+      }
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "best") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (ImageWidth(img[n-2]) > ImageWidth(img[n-1]) || ImageHeight(img[n-2]) > ImageHeight(img[n-1])) {
+        err = 6; break;
+      }
+      fprintf(stderr, "Locating best match of I%d in I%d\n", n-2, n-1);
+      uint64_t score;
+      if (!ImageLocateBest(img[n-1], img[n-2], &x, &y, &score)) { err = 4; break; }
+      printf("# BEST (%d,%d) SSD %" PRIu64 "\n", x, y, score);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (!ImageBlur(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "map") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Mapping %s -> I%d\n", av[k], n);
+      img[n] = ImageLoadMapped(av[k], 1);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -218,8 +432,12 @@ int main(int ac, char* av[]) {
   }
   
   // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  if (arena != NULL) {
+    ImageArenaRelease(&arena);
+  } else {
+    while (n > 0) {
+      ImageDestroy(&img[--n]);
+    }
   }
 
   error(err, errno, errors[err], ImageErrMsg());
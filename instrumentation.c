@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: InstrPrint calibrates when first needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +18,22 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread counts in its own copy of InstrCount, so that threads never
+/// contend for the counters.  Threads other than the main one must call
+/// InstrThreadStart when they start and InstrThreadStop before they end, so
+/// that InstrReset and InstrPrint see their counts.
 
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#if !(defined(_MSC_VER) || defined(_WIN32) || defined(_WIN64))
+#include <sys/stat.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +54,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +86,161 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// The performance counter already measures elapsed real time
+double wall_time(void) {
+  return cpu_time();
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
+
+// Hardware performance counters (Linux perf events), on request:
+// see InstrPerf in instrumentation.h.
+#define NUMPERF 5
+
+static const char* const perfName[NUMPERF] = {
+  "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses",
+};
+
+// Reading of a perf event:  its count, and for how long it was enabled and
+// actually running on a hardware counter (less, when the kernel multiplexes
+// more events than there are counters)
+struct perfCount {
+  unsigned long long value, enabled, running;
+};
+
+// Registered counters of a thread
+struct instrThread {
+  unsigned long* count;
+  int perfOpen;        // whether perf below was set (by perfOpen)
+  int perf[NUMPERF];   // perf event file descriptors (-1 if not available)
+  struct perfCount perfBase[NUMPERF];  // readings at the last reset
+  struct instrThread* next;
+};
+
+static pthread_mutex_t instrLock = PTHREAD_MUTEX_INITIALIZER;
+static struct instrThread* instrThreads;      // registered threads (protected by instrLock)
+static unsigned long instrStopped[NUMCOUNTERS];  // counts of threads that stopped
+static unsigned long long perfStopped[NUMPERF];  // perf counts of threads that stopped
+static int perfScaled[NUMPERF];  // whether some count of event e was scaled
+static _Thread_local struct instrThread instrSelf;  // entry of the calling thread
+
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const struct {
+  unsigned type;
+  unsigned long long config;
+} perfEvent[NUMPERF] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+// Open the perf events of the calling thread (user space only, so that
+// the default perf_event_paranoid setting allows them).
+// Events that cannot be opened are left at -1.  Preserves errno.
+static void perfOpen(struct instrThread* t) {
+  int errsave = errno;
+  for (int e = 0; e < NUMPERF; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perfEvent[e].type;
+    attr.config = perfEvent[e].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    t->perf[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    memset(&t->perfBase[e], 0, sizeof(t->perfBase[e]));
+  }
+  t->perfOpen = 1;
+  errno = errsave;
+}
+
+// Current reading of event e of thread t (all 0 if not available).
+static struct perfCount perfCount(struct instrThread* t, int e) {
+  struct perfCount c = {0, 0, 0};
+  if (!t->perfOpen || t->perf[e] < 0 || read(t->perf[e], &c, sizeof(c)) != sizeof(c))
+    memset(&c, 0, sizeof(c));
+  return c;
+}
+
+// Value of event e of thread t since the last reset (0 if not available).
+// If the event was multiplexed, only counting part of that time, the count
+// is scaled up to the whole time, and *scaled is set.
+static unsigned long long perfRead(struct instrThread* t, int e, int* scaled) {
+  struct perfCount c = perfCount(t, e);
+  unsigned long long value = c.value - t->perfBase[e].value;
+  unsigned long long enabled = c.enabled - t->perfBase[e].enabled;
+  unsigned long long running = c.running - t->perfBase[e].running;
+  if (running < enabled) {
+    *scaled = 1;
+    value = running == 0 ? 0 : (unsigned long long)((double)value * enabled / running);
+  }
+  return value;
+}
+
+// Start counting events of thread t from zero.  (The times enabled and
+// running cannot be reset, so the current readings are kept as the base.)
+static void perfReset(struct instrThread* t) {
+  for (int e = 0; t->perfOpen && e < NUMPERF; e++)
+    t->perfBase[e] = perfCount(t, e);
+}
+
+static void perfClose(struct instrThread* t) {
+  for (int e = 0; t->perfOpen && e < NUMPERF; e++)
+    if (t->perf[e] >= 0)
+      close(t->perf[e]);
+  t->perfOpen = 0;
+}
+
+#else
+
+// No perf events outside Linux
+static void perfOpen(struct instrThread* t) {
+  for (int e = 0; e < NUMPERF; e++)
+    t->perf[e] = -1;
+  t->perfOpen = 1;
+}
+
+static unsigned long long perfRead(struct instrThread* t, int e, int* scaled) {
+  (void)t;
+  (void)e;
+  (void)scaled;
+  return 0;
+}
+
+static void perfReset(struct instrThread* t) { (void)t; }
+
+static void perfClose(struct instrThread* t) { t->perfOpen = 0; }
+
+#endif
+
+// Whether perf events were requested (-1 until InstrPerf is first called)
+static int perfWanted = -1;
+
+/// Whether hardware performance counters are in use:
+/// if the INSTR_PERF environment variable is set to a nonzero number,
+/// InstrReset starts, and InstrPrint shows, the perf events of all
+/// counting threads, where the system permits it.
+int InstrPerf(void) { ///
+  pthread_mutex_lock(&instrLock);
+  if (perfWanted < 0) {
+    const char* env = getenv("INSTR_PERF");
+    perfWanted = env != NULL && atoi(env) != 0;
+  }
+  pthread_mutex_unlock(&instrLock);
+  return perfWanted;
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -79,7 +250,8 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, initially 1s;
+/// see InstrCalibrateOnce)
 double InstrCTU = 1.0;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
@@ -101,29 +273,243 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+// Name of the calibration cache file (in buf, of size n).
+// Returns NULL if there is none.
+static const char* ctuCacheName(char* buf, size_t n) {
+  const char* name = getenv("INSTR_CTU_CACHE");
+  if (name != NULL)
+    return name[0] != '\0' ? name : NULL;  // empty: no cache
+  const char* home = getenv("HOME");
+  if (home == NULL || snprintf(buf, n, "%s/.cache/instr_ctu", home) >= (int)n)
+    return NULL;
+  return buf;
+}
+
+// Create the missing directories on the path to file name (for the cache
+// file, so they are accessible by the user only).  Errors are ignored:
+// then the file cannot be created either.
+static void ctuCacheDirs(const char* name) {
+  char dir[512];
+  if (snprintf(dir, sizeof(dir), "%s", name) >= (int)sizeof(dir))
+    return;
+  for (char* p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+#if defined(_MSC_VER) || defined(_WIN32) || defined(_WIN64)
+    CreateDirectoryA(dir, NULL);
+#else
+    mkdir(dir, 0700);
+#endif
+    *p = '/';
+  }
+}
+
+// Model of the CPU (in buf, of size n), which keys the cache:
+// the CTU depends on it.
+static const char* cpuModel(char* buf, size_t n) {
+  snprintf(buf, n, "unknown");
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL)
+    return buf;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      colon += 1 + strspn(colon + 1, " \t");
+      colon[strcspn(colon, "\n")] = '\0';
+      snprintf(buf, n, "%s", colon);
+      break;
+    }
+  }
+  fclose(f);
+  return buf;
+}
+
+// CTU stored for model in the cache file name, or 0 if none.
+// Each line of the file is:  CTU <tab> model
+static double ctuCacheRead(const char* name, const char* model) {
+  FILE* f = fopen(name, "r");
+  if (f == NULL)
+    return 0.0;
+  double ctu = 0.0;
+  char line[320];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* tab = strchr(line, '\t');
+    if (tab == NULL)
+      continue;
+    tab[1 + strcspn(tab + 1, "\n")] = '\0';
+    if (strcmp(tab + 1, model) == 0)
+      ctu = atof(line);
+  }
+  fclose(f);
+  return ctu;
+}
+
+/// Set InstrCTU, the first time it is called:
+/// from the INSTR_CTU environment variable, if set (in seconds);
+/// otherwise from the calibration cache file ($INSTR_CTU_CACHE, or else
+/// ~/.cache/instr_ctu), if it holds a CTU for this CPU model;
+/// otherwise by InstrCalibrate, saving the result in the cache file
+/// (creating its missing directories, accessible by the user only).
+/// InstrPrint calls it, so programs that never print pay nothing.
+void InstrCalibrateOnce(void) { ///
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static int done = 0;
+  pthread_mutex_lock(&lock);
+  if (!done) {
+    int errsave = errno;
+    const char* env = getenv("INSTR_CTU");
+    char namebuf[512], model[256];
+    const char* name = ctuCacheName(namebuf, sizeof(namebuf));
+    cpuModel(model, sizeof(model));
+    double ctu = env != NULL ? atof(env) : 0.0;
+    if (!(ctu > 0.0 && isfinite(ctu)) && name != NULL)
+      ctu = ctuCacheRead(name, model);
+    if (ctu > 0.0 && isfinite(ctu)) {
+      InstrCTU = ctu;
+    } else {
+      InstrCalibrate();
+      if (name != NULL)
+        ctuCacheDirs(name);
+      FILE* f = name != NULL ? fopen(name, "a") : NULL;
+      if (f != NULL) {
+        fprintf(f, "%.9g\t%s\n", InstrCTU, model);
+        fclose(f);
+      }
+    }
+    errno = errsave;
+    done = 1;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/// Register the counters of the calling thread.
+void InstrThreadStart(void) { ///
+  if (InstrPerf() && !instrSelf.perfOpen)
+    perfOpen(&instrSelf);
+  pthread_mutex_lock(&instrLock);
+  instrSelf.count = InstrCount;
+  instrSelf.next = instrThreads;
+  instrThreads = &instrSelf;
+  pthread_mutex_unlock(&instrLock);
+}
+
+/// Unregister the counters of the calling thread.
+/// Its counts are kept, and still show in InstrTotal and InstrPrint.
+void InstrThreadStop(void) { ///
+  pthread_mutex_lock(&instrLock);
+  struct instrThread** p = &instrThreads;
+  while (*p != NULL && *p != &instrSelf)
+    p = &(*p)->next;
+  if (*p != NULL) {
+    *p = instrSelf.next;
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      instrStopped[i] += InstrCount[i];
+    for (int e = 0; e < NUMPERF; e++)
+      perfStopped[e] += perfRead(&instrSelf, e, &perfScaled[e]);
+    instrSelf.count = NULL;
+  }
+  pthread_mutex_unlock(&instrLock);
+  perfClose(&instrSelf);
+}
+
+/// Reset counters of all threads to zero and store cpu_time.
+/// Other threads should not be counting meanwhile.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
+  if (InstrPerf() && !instrSelf.perfOpen)
+    perfOpen(&instrSelf);
+  pthread_mutex_lock(&instrLock);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
     InstrCount[i] = 0ul;
+    instrStopped[i] = 0ul;
+    for (struct instrThread* t = instrThreads; t != NULL; t = t->next)
+      t->count[i] = 0ul;
+  }
+  memset(perfStopped, 0, sizeof(perfStopped));
+  memset(perfScaled, 0, sizeof(perfScaled));
+  if (instrSelf.count != InstrCount)  // (registered threads are reset below)
+    perfReset(&instrSelf);
+  for (struct instrThread* t = instrThreads; t != NULL; t = t->next)
+    perfReset(t);
+  pthread_mutex_unlock(&instrLock);
   InstrTime = cpu_time();
 }
 
-// Print times and all named counter values
+/// Value of counter i, added up over all threads.
+/// Other threads should not be counting meanwhile.
+unsigned long InstrTotal(int i) { ///
+  pthread_mutex_lock(&instrLock);
+  unsigned long total = instrStopped[i];
+  if (instrSelf.count != InstrCount)  // (registered threads are counted below)
+    total += InstrCount[i];
+  for (struct instrThread* t = instrThreads; t != NULL; t = t->next)
+    total += t->count[i];
+  pthread_mutex_unlock(&instrLock);
+  return total;
+}
+
+// Value of perf event e, added up over all threads.
+// Sets *scaled if some thread's count was scaled (see perfRead).
+static unsigned long long perfTotal(int e, int* scaled) {
+  pthread_mutex_lock(&instrLock);
+  unsigned long long total = perfStopped[e];
+  *scaled = perfScaled[e];
+  if (instrSelf.count != InstrCount)  // (registered threads are counted below)
+    total += perfRead(&instrSelf, e, scaled);
+  for (struct instrThread* t = instrThreads; t != NULL; t = t->next)
+    total += perfRead(t, e, scaled);
+  pthread_mutex_unlock(&instrLock);
+  return total;
+}
+
+/// Print times and all named counter values (added up over all threads),
+/// followed by the perf events that are in use (see InstrPerf).
+/// Events the kernel had to multiplex (count only part of the time) are
+/// scaled up to the whole time, and their names marked with a '*'.
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+
+  // Perf events shown:  those the calling thread could open.
+  // Scaled counts are estimates, and are marked with a '*'.
+  // (Read before calibrating, which would be counted too.)
+  int shown[NUMPERF] = {0};
+  unsigned long long perf[NUMPERF];
+  int scaled[NUMPERF] = {0};
+  int nshown = 0, nscaled = 0;
+  for (int e = 0; e < NUMPERF; e++) {
+    shown[e] = instrSelf.perfOpen && instrSelf.perf[e] >= 0;
+    if (shown[e]) {
+      perf[e] = perfTotal(e, &scaled[e]);
+      nscaled += scaled[e];
+    }
+    nshown += shown[e];
+  }
   // compute time in calibrated time units:
+  InstrCalibrateOnce();
   double caltime = time / InstrCTU;
+  static int warned = 0;
+  if (InstrPerf() && nshown == 0 && !warned) {
+    fprintf(stderr, "Perf events not available (not supported, or not permitted by perf_event_paranoid)\n");
+    warned = 1;
+  }
+  if (nscaled > 0) {
+    fprintf(stderr, "Perf events marked * were multiplexed: their counts are scaled estimates\n");
+  }
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int e = 0; e < NUMPERF; e++)
+    if (shown[e])
+      printf(scaled[e] ? "\t%14.14s*" : "\t%15.15s", perfName[e]);
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", InstrTotal(i));
+  for (int e = 0; e < NUMPERF; e++)
+    if (shown[e])
+      printf("\t%15llu", perf[e]);
   puts("");
 }
-
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: InstrPrint calibrates when first needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,6 +18,11 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread counts in its own copy of InstrCount, so that threads never
+/// contend for the counters.  Threads other than the main one must call
+/// InstrThreadStart when they start and InstrThreadStop before they end, so
+/// that InstrReset and InstrPrint see their counts.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -25,11 +30,15 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (elapsed real) time in seconds.
+/// Unlike cpu_time, this does not add up the time of concurrent threads.
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -37,7 +46,8 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, initially 1s;
+/// see InstrCalibrateOnce)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
@@ -45,9 +55,40 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Set InstrCTU, the first time it is called:
+/// from the INSTR_CTU environment variable, if set (in seconds);
+/// otherwise from the calibration cache file ($INSTR_CTU_CACHE, or else
+/// ~/.cache/instr_ctu), if it holds a CTU for this CPU model;
+/// otherwise by InstrCalibrate, saving the result in the cache file
+/// (creating its missing directories, accessible by the user only).
+/// InstrPrint calls it, so programs that never print pay nothing.
+void InstrCalibrateOnce(void) ;
+
+/// Register the counters of the calling thread.
+void InstrThreadStart(void) ;
+
+/// Unregister the counters of the calling thread.
+/// Its counts are kept, and still show in InstrTotal and InstrPrint.
+void InstrThreadStop(void) ;
+
+/// Whether hardware performance counters are in use:
+/// if the INSTR_PERF environment variable is set to a nonzero number,
+/// InstrReset starts, and InstrPrint shows, the perf events of all
+/// counting threads, where the system permits it.
+int InstrPerf(void) ;
+
+/// Reset counters of all threads to zero and store cpu_time.
+/// Other threads should not be counting meanwhile.
 void InstrReset(void) ;
 
+/// Value of counter i, added up over all threads.
+/// Other threads should not be counting meanwhile.
+unsigned long InstrTotal(int i) ;
+
+/// Print times and all named counter values (added up over all threads),
+/// followed by the perf events that are in use (see InstrPerf).
+/// Events the kernel had to multiplex (count only part of the time) are
+/// scaled up to the whole time, and their names marked with a '*'.
 void InstrPrint(void) ;
 
 #endif